@@ -0,0 +1,185 @@
+#include "batch.h"
+#include <dirent.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define error(...) (fprintf(stderr, __VA_ARGS__))
+#define MAX_MANIFEST_LINE_SIZE 4096
+
+static int add_batch_entry(BATCH* batch, char* input_filename, char* output_filename) {
+    if (batch->count == batch->capacity) {
+        int capacity = batch->capacity > 0 ? batch->capacity * 2 : 64;
+        BATCH_ENTRY* entries = (BATCH_ENTRY*)realloc(batch->entries, capacity * sizeof(BATCH_ENTRY));
+        if (entries == NULL) {
+            error("%s\n", "Could not allocate memory for the batch");
+            return 1;
+        }
+        batch->entries = entries;
+        batch->capacity = capacity;
+    }
+    batch->entries[batch->count].input_filename = input_filename;
+    batch->entries[batch->count].output_filename = output_filename;
+    batch->count++;
+    return 0;
+}
+
+static char* copy_string(char* string) {
+    char* copy = (char*)malloc(strlen(string) + 1);
+    if (copy != NULL) {
+        strcpy(copy, string);
+    }
+    return copy;
+}
+
+static char* join_path(char* directory, char* name) {
+    size_t directory_length = strlen(directory);
+    char* path = (char*)malloc(directory_length + strlen(name) + 2);
+    if (path != NULL) {
+        strcpy(path, directory);
+        if (directory_length > 0 && directory[directory_length - 1] != '/') {
+            strcat(path, "/");
+        }
+        strcat(path, name);
+    }
+    return path;
+}
+
+int read_batch_manifest(char* manifest_filename, BATCH* batch) {
+    char line[MAX_MANIFEST_LINE_SIZE];
+    char input_filename[MAX_MANIFEST_LINE_SIZE];
+    char output_filename[MAX_MANIFEST_LINE_SIZE];
+    int line_number = 0;
+    FILE* manifest = fopen(manifest_filename, "r");
+    if (manifest == NULL) {
+        error("Could not open the manifest %s\n", manifest_filename);
+        return 1;
+    }
+    while (fgets(line, sizeof(line), manifest) != NULL) {
+        char extra[2];
+        line_number++;
+        int fields = sscanf(line, "%4095s %4095s %1s", input_filename, output_filename, extra);
+        if (fields <= 0) {
+            continue;
+        }
+        if (fields != 2) {
+            error("Manifest line %d must contain an input and an output file name\n", line_number);
+            fclose(manifest);
+            return 1;
+        }
+        char* input_copy = copy_string(input_filename);
+        char* output_copy = copy_string(output_filename);
+        if (input_copy == NULL || output_copy == NULL || add_batch_entry(batch, input_copy, output_copy)) {
+            free(input_copy);
+            free(output_copy);
+            fclose(manifest);
+            return 1;
+        }
+    }
+    fclose(manifest);
+    return 0;
+}
+
+static int compare_entries(const void* first, const void* second) {
+    return strcmp(((BATCH_ENTRY*)first)->input_filename, ((BATCH_ENTRY*)second)->input_filename);
+}
+
+int read_batch_directory(char* input_directory, char* output_directory, BATCH* batch) {
+    struct dirent* entry;
+    int first_entry = batch->count;
+    DIR* directory = opendir(input_directory);
+    if (directory == NULL) {
+        error("Could not open the directory %s\n", input_directory);
+        return 1;
+    }
+    while ((entry = readdir(directory)) != NULL) {
+        if (!is_bmp_filename(entry->d_name)) {
+            continue;
+        }
+        char* input_filename = join_path(input_directory, entry->d_name);
+        char* output_filename = join_path(output_directory, entry->d_name);
+        if (input_filename == NULL || output_filename == NULL
+            || add_batch_entry(batch, input_filename, output_filename)) {
+            free(input_filename);
+            free(output_filename);
+            closedir(directory);
+            return 1;
+        }
+    }
+    closedir(directory);
+    qsort(batch->entries + first_entry, batch->count - first_entry, sizeof(BATCH_ENTRY), compare_entries);
+    return 0;
+}
+
+void free_batch(BATCH* batch) {
+    for (int i = 0; i < batch->count; i++) {
+        free(batch->entries[i].input_filename);
+        free(batch->entries[i].output_filename);
+    }
+    free(batch->entries);
+    batch->entries = NULL;
+    batch->count = batch->capacity = 0;
+}
+
+typedef struct {
+    BMPv3* image;
+    char* filename;
+    BMPv3_STATUS status;
+} BATCH_READ;
+
+static void* read_batch_image(void* argument) {
+    BATCH_READ* read = (BATCH_READ*)argument;
+    read->status = read_BMPv3_file_into(read->image, read->filename);
+    return NULL;
+}
+
+int run_batch(BATCH* batch, int (*process)(BMPv3* image, void* context), void* context) {
+    BMPv3* images[2];
+    BATCH_READ reads[2];
+    int failed_count = 0;
+    if (batch->count == 0) {
+        return 0;
+    }
+    images[0] = BMPv3_create();
+    images[1] = BMPv3_create();
+    if (images[0] == NULL || images[1] == NULL) {
+        error("%s\n", BMP_get_status_description(BMPv3_OUT_OF_MEMORY));
+        BMPv3_reuse(images[0]);
+        BMPv3_reuse(images[1]);
+        return batch->count;
+    }
+    reads[0].image = images[0];
+    reads[0].filename = batch->entries[0].input_filename;
+    read_batch_image(&reads[0]);
+    for (int i = 0; i < batch->count; i++) {
+        BATCH_READ* current = &reads[i % 2];
+        BATCH_READ* next = &reads[(i + 1) % 2];
+        pthread_t reader;
+        int reader_started = 0;
+        if (i + 1 < batch->count) {
+            next->image = images[(i + 1) % 2];
+            next->filename = batch->entries[i + 1].input_filename;
+            reader_started = pthread_create(&reader, NULL, read_batch_image, next) == 0;
+        }
+        if (current->status != BMPv3_OK) {
+            error("%s: %s\n", current->filename, BMP_get_status_description(current->status));
+            failed_count++;
+        } else if (process(current->image, context) != 0) {
+            failed_count++;
+        } else {
+            write_BMPv3_file(current->image, batch->entries[i].output_filename);
+            if (BMP_get_error() != BMPv3_OK) {
+                error("%s: %s\n", batch->entries[i].output_filename, BMP_get_error_description());
+                failed_count++;
+            }
+        }
+        if (reader_started) {
+            pthread_join(reader, NULL);
+        } else if (i + 1 < batch->count) {
+            read_batch_image(next);
+        }
+    }
+    BMPv3_reuse(images[0]);
+    BMPv3_reuse(images[1]);
+    return failed_count;
+}
@@ -0,0 +1,32 @@
+#include "bmp_handler.h"
+
+#ifndef HOMEWORK_4_BATCH_H
+#define HOMEWORK_4_BATCH_H
+
+typedef struct {
+    char* input_filename;
+    char* output_filename;
+} BATCH_ENTRY;
+
+typedef struct {
+    BATCH_ENTRY* entries;
+    int count;
+    int capacity;
+} BATCH;
+
+/* Appends the "<input>.bmp <output>.bmp" pairs listed one per line in the manifest.
+   Returns 0 on success; otherwise prints the problem to stderr and returns 1. */
+int read_batch_manifest(char* manifest_filename, BATCH* batch);
+
+/* Appends every .bmp file of input_directory, to be written under the same name to output_directory. */
+int read_batch_directory(char* input_directory, char* output_directory, BATCH* batch);
+
+void free_batch(BATCH* batch);
+
+/* Reads every entry, calls process on the image and writes it to the entry's output file.
+   The next file is read on a second thread while the current one is processed and written,
+   and the same two pooled BMPv3 objects (and their pixel buffers) are reused for the whole batch.
+   A failed entry is reported to stderr and skipped; returns the number of failed entries. */
+int run_batch(BATCH* batch, int (*process)(BMPv3* image, void* context), void* context);
+
+#endif //HOMEWORK_4_BATCH_H
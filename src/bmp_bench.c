@@ -0,0 +1,358 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "bmp_handler.h"
+#include "comparison.h"
+#include "difference.h"
+#include "lut.h"
+#include "negation.h"
+#include "qdbmp.h"
+
+#define error(...) (fprintf(stderr, __VA_ARGS__))
+#define PALETTE_SIZE_8bpp (256 * 4)
+#define HEADER_BYTES_SIZE 54
+#define MAX_SIZES_COUNT 16
+#define MAX_PATH_SIZE 4096
+#define DEFAULT_ITERATIONS 10
+#define DEFAULT_WARMUP 2
+#define MAX_LUT_TAIL_SIZE 256
+
+typedef struct {
+    long int widths[MAX_SIZES_COUNT];
+    long int heights[MAX_SIZES_COUNT];
+    int sizes_count;
+    int iterations;
+    int warmup;
+    char* directory;
+} BENCH_OPTIONS;
+
+typedef struct {
+    char input_filename[MAX_PATH_SIZE];
+    char output_filename[MAX_PATH_SIZE];
+    BMPv3* image;
+    BMPv3* copy;
+    BMP* theirs;
+    LUT_KERNEL lut_kernel;
+    unsigned char lut_tables[LUT_CHANNELS_COUNT][256];
+} BENCH_CASE;
+
+typedef void (*bench_stage)(BENCH_CASE* bench_case);
+
+static double seconds_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static int compare_doubles(const void* first, const void* second) {
+    double a = *(const double*)first, b = *(const double*)second;
+    return (a > b) - (a < b);
+}
+
+static double percentile(double* sorted, int count, int percent) {
+    int index = (count * percent + 99) / 100 - 1;
+    return sorted[index < 0 ? 0 : index];
+}
+
+/* Writes a bottom-up BMP filled with pseudo-random pixels (and a pseudo-random palette for 8 bpp). */
+static int generate_image(char* filename, long int width, long int height, short bits_per_pixel) {
+    BMPv3 bmp;
+    unsigned char palette[PALETTE_SIZE_8bpp];
+    unsigned int seed = 12345;
+    memset(&bmp, 0, sizeof(BMPv3));
+    bmp.header.magic = 0x4D42;
+    bmp.header.header_size = 40;
+    bmp.header.width = width;
+    bmp.header.height = height;
+    bmp.header.planes = 1;
+    bmp.header.bits_per_pixel = bits_per_pixel;
+    bmp.header.image_data_size = get_BMPv3_row_size(&bmp) * height;
+    bmp.header.data_offset = get_BMPv3_data_offset(&bmp);
+    bmp.header.file_size = bmp.header.data_offset + bmp.header.image_data_size;
+    bmp.data = (unsigned char*)malloc(bmp.header.image_data_size);
+    if (bmp.data == NULL) {
+        return 1;
+    }
+    for (long int i = 0; i < bmp.header.image_data_size; i++) {
+        seed = seed * 1103515245 + 12345;
+        bmp.data[i] = (unsigned char)(seed >> 16);
+    }
+    if (bits_per_pixel == 8) {
+        for (int i = 0; i < PALETTE_SIZE_8bpp; i++) {
+            seed = seed * 1103515245 + 12345;
+            palette[i] = (i + 1) % 4 == 0 ? 0 : (unsigned char)(seed >> 16);
+        }
+        bmp.palette = palette;
+    }
+    write_BMPv3_file(&bmp, filename);
+    free(bmp.data);
+    return BMP_get_error() != BMPv3_OK;
+}
+
+static void stage_read(BENCH_CASE* bench_case) {
+    BMPv3_free(read_BMPv3_file(bench_case->input_filename));
+}
+
+static void stage_negate_mine(BENCH_CASE* bench_case) {
+    BMPv3* image = bench_case->image;
+    if (image->header.bits_per_pixel == 8) {
+        for (int i = 0; i < PALETTE_SIZE_8bpp; i++) {
+            if ((i + 1) % 4 != 0) {
+                image->palette[i] = ~image->palette[i];
+            }
+        }
+    } else {
+        negate_bytes(image->data, image->data, image->header.image_data_size);
+    }
+}
+
+static void negate_theirs_row(UCHAR* row, UINT width, USHORT depth, void* context) {
+    (void)context;
+    for (UINT i = 0; i < width * (depth / 8); i++) {
+        row[i] = 255 - row[i];
+    }
+}
+
+static void stage_negate_theirs(BENCH_CASE* bench_case) {
+    BMP* image = bench_case->theirs;
+    UCHAR r, g, b;
+    if (BMP_GetDepth(image) == 8) {
+        for (int i = 0; i < 256; i++) {
+            BMP_GetPaletteColor(image, (UCHAR)i, &r, &g, &b);
+            BMP_SetPaletteColor(image, (UCHAR)i, ~r, ~g, ~b);
+        }
+    } else {
+        BMP_TransformRows(image, 0, BMP_GetHeight(image), negate_theirs_row, NULL);
+    }
+}
+
+static void stage_write(BENCH_CASE* bench_case) {
+    write_BMPv3_file(bench_case->image, bench_case->output_filename);
+}
+
+static void stage_compare(BENCH_CASE* bench_case) {
+    compare_images(bench_case->image, bench_case->copy, NULL, NULL);
+}
+
+static void stage_compare_tolerant(BENCH_CASE* bench_case) {
+    COMPARISON_SETTINGS settings = {.tolerance = 255};
+    compare_images(bench_case->image, bench_case->copy, NULL, &settings);
+}
+
+/* Different tables for every channel, so the SIMD kernels look up and blend all three. */
+static void build_lut_tables(unsigned char tables[LUT_CHANNELS_COUNT][256]) {
+    unsigned int seed = 54321;
+    for (int c = 0; c < LUT_CHANNELS_COUNT; c++) {
+        for (int i = 0; i < 256; i++) {
+            seed = seed * 1103515245 + 12345;
+            tables[c][i] = (unsigned char)(seed >> 16);
+        }
+    }
+}
+
+static void stage_lut(BENCH_CASE* bench_case) {
+    BMPv3* image = bench_case->image;
+    size_t size = image->header.image_data_size / LUT_CHANNELS_COUNT * LUT_CHANNELS_COUNT;
+    bench_case->lut_kernel.lookup(image->data, image->data, size, (const unsigned char(*)[256])bench_case->lut_tables);
+}
+
+/* Runs every kernel over the whole image and over each short length, with the channel tables
+   both different and all the same, and checks that the output is what the portable loop writes. */
+static int check_lut_kernels(BENCH_CASE* bench_case, LUT_KERNEL* kernels, int kernels_count) {
+    BMPv3* image = bench_case->image;
+    LUT_KERNEL* portable = &kernels[kernels_count - 1];
+    unsigned char same_tables[LUT_CHANNELS_COUNT][256];
+    size_t size = image->header.image_data_size;
+    unsigned char* expected = (unsigned char*)malloc(size);
+    unsigned char* actual = (unsigned char*)malloc(size);
+    int failed = expected == NULL || actual == NULL;
+    for (int c = 0; c < LUT_CHANNELS_COUNT; c++) {
+        memcpy(same_tables[c], bench_case->lut_tables[0], 256);
+    }
+    for (int k = 0; k < kernels_count - 1 && !failed; k++) {
+        for (int same = 0; same < 2 && !failed; same++) {
+            const unsigned char(*tables)[256] = same ? (const unsigned char(*)[256])same_tables
+                                                     : (const unsigned char(*)[256])bench_case->lut_tables;
+            for (size_t length = 0; length <= MAX_LUT_TAIL_SIZE + 1 && !failed; length++) {
+                size_t checked_size = length <= MAX_LUT_TAIL_SIZE && length < size ? length : size;
+                portable->lookup(expected, image->data, checked_size, tables);
+                kernels[k].lookup(actual, image->data, checked_size, tables);
+                if (memcmp(expected, actual, checked_size) != 0) {
+                    error("Lookup kernel %s differs from the portable loop on %zu bytes\n", kernels[k].name,
+                          checked_size);
+                    failed = 1;
+                }
+            }
+        }
+    }
+    free(expected);
+    free(actual);
+    return failed;
+}
+
+static void run_stage(char* name, bench_stage stage, BENCH_CASE* bench_case, BENCH_OPTIONS* options,
+                      double* times) {
+    BMPv3_Header* header = &bench_case->image->header;
+    for (int i = 0; i < options->warmup; i++) {
+        stage(bench_case);
+    }
+    for (int i = 0; i < options->iterations; i++) {
+        double start = seconds_now();
+        stage(bench_case);
+        times[i] = seconds_now() - start;
+    }
+    qsort(times, options->iterations, sizeof(double), compare_doubles);
+    double median = percentile(times, options->iterations, 50);
+    printf("%-14s %6ldx%-6ld %3d %9.3f %9.3f %9.3f %9.3f %10.1f %9.1f\n", name, header->width, labs(header->height),
+           header->bits_per_pixel, times[0] * 1e3, median * 1e3, percentile(times, options->iterations, 90) * 1e3,
+           times[options->iterations - 1] * 1e3, header->image_data_size / median / 1e6,
+           header->width * labs(header->height) / median / 1e6);
+}
+
+/* Times every lookup kernel the CPU can run, once each has been checked against the portable loop. */
+static int run_lut_stages(BENCH_CASE* bench_case, BENCH_OPTIONS* options, double* times) {
+    LUT_KERNEL kernels[LUT_KERNELS_MAX_COUNT];
+    int kernels_count = get_lookup_pixels_kernels(kernels);
+    build_lut_tables(bench_case->lut_tables);
+    if (check_lut_kernels(bench_case, kernels, kernels_count)) {
+        return 1;
+    }
+    for (int k = 0; k < kernels_count; k++) {
+        char name[32];
+        snprintf(name, sizeof(name), "lut %s", kernels[k].name);
+        bench_case->lut_kernel = kernels[k];
+        run_stage(name, stage_lut, bench_case, options, times);
+    }
+    return 0;
+}
+
+static int run_case(long int width, long int height, short bits_per_pixel, BENCH_OPTIONS* options, double* times) {
+    BENCH_CASE bench_case;
+    snprintf(bench_case.input_filename, MAX_PATH_SIZE, "%s/bmp_bench_%ldx%ld_%d.bmp", options->directory,
+             width, height, bits_per_pixel);
+    snprintf(bench_case.output_filename, MAX_PATH_SIZE, "%s/bmp_bench_%ldx%ld_%d_out.bmp", options->directory,
+             width, height, bits_per_pixel);
+    if (generate_image(bench_case.input_filename, width, height, bits_per_pixel)) {
+        error("Could not generate %s\n", bench_case.input_filename);
+        return 1;
+    }
+    bench_case.image = read_BMPv3_file(bench_case.input_filename);
+    bench_case.copy = read_BMPv3_file(bench_case.input_filename);
+    bench_case.theirs = BMP_ReadFile(bench_case.input_filename);
+    if (bench_case.image == NULL || bench_case.copy == NULL || bench_case.theirs == NULL) {
+        error("Could not read %s\n", bench_case.input_filename);
+        return 1;
+    }
+    run_stage("read", stage_read, &bench_case, options, times);
+    /* Compared while both copies are still identical, so every row is scanned and nothing is printed. */
+    run_stage("compare", stage_compare, &bench_case, options, times);
+    run_stage("negate mine", stage_negate_mine, &bench_case, options, times);
+    /* Every row differs from the copy now, so each goes through measure_differences,
+       and with the largest tolerance no pixel is printed. */
+    run_stage("compare tol", stage_compare_tolerant, &bench_case, options, times);
+    run_stage("negate theirs", stage_negate_theirs, &bench_case, options, times);
+    /* Indexed images only ever have their palette looked up, so the pixel kernels run on 24 bpp. */
+    int failed = bits_per_pixel == 24 && run_lut_stages(&bench_case, options, times);
+    run_stage("write", stage_write, &bench_case, options, times);
+    BMPv3_free(bench_case.image);
+    BMPv3_free(bench_case.copy);
+    BMP_Free(bench_case.theirs);
+    remove(bench_case.input_filename);
+    remove(bench_case.output_filename);
+    return failed;
+}
+
+static int scan_count(char* argument, int minimum, int* value) {
+    char* end;
+    long int number = strtol(argument, &end, 10);
+    if (*argument == '\0' || *end != '\0' || number < minimum || number > 1000000) {
+        return 1;
+    }
+    *value = (int)number;
+    return 0;
+}
+
+static int scan_sizes(char* argument, BENCH_OPTIONS* options) {
+    char* position = argument;
+    options->sizes_count = 0;
+    while (*position != '\0') {
+        char* end;
+        if (options->sizes_count == MAX_SIZES_COUNT) {
+            return 1;
+        }
+        long int width = strtol(position, &end, 10);
+        if (*end != 'x' || width <= 0) {
+            return 1;
+        }
+        long int height = strtol(end + 1, &end, 10);
+        if ((*end != ',' && *end != '\0') || height <= 0) {
+            return 1;
+        }
+        options->widths[options->sizes_count] = width;
+        options->heights[options->sizes_count] = height;
+        options->sizes_count++;
+        position = *end == ',' ? end + 1 : end;
+    }
+    return options->sizes_count == 0;
+}
+
+int scan_arguments(int count_of_arguments, char** arguments, BENCH_OPTIONS* options) {
+    options->widths[0] = options->heights[0] = 1024;
+    options->widths[1] = options->heights[1] = 4096;
+    options->sizes_count = 2;
+    options->iterations = DEFAULT_ITERATIONS;
+    options->warmup = DEFAULT_WARMUP;
+    options->directory = ".";
+    for (int i = 1; i < count_of_arguments; i++) {
+        int has_value = i + 1 < count_of_arguments;
+        if (strcmp(arguments[i], "--sizes") == 0 && has_value) {
+            if (scan_sizes(arguments[++i], options)) {
+                error("%s\n", "Sizes must look like 1024x768,4096x4096");
+                return 1;
+            }
+        } else if (strcmp(arguments[i], "--iterations") == 0 && has_value) {
+            if (scan_count(arguments[++i], 1, &options->iterations)) {
+                error("%s\n", "Count of iterations must be a positive number");
+                return 1;
+            }
+        } else if (strcmp(arguments[i], "--warmup") == 0 && has_value) {
+            if (scan_count(arguments[++i], 0, &options->warmup)) {
+                error("%s\n", "Count of warmup runs must be a non-negative number");
+                return 1;
+            }
+        } else if (strcmp(arguments[i], "--dir") == 0 && has_value) {
+            options->directory = arguments[++i];
+        } else {
+            error("%s\n", "Usage: bmp_bench [--sizes WxH[,WxH...]] [--iterations N] [--warmup N] [--dir path]");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    BENCH_OPTIONS options;
+    if (scan_arguments(argc, argv, &options)) {
+        return -1;
+    }
+    double* times = (double*)malloc(options.iterations * sizeof(double));
+    if (times == NULL) {
+        error("%s\n", "Could not allocate memory for the timings");
+        return -1;
+    }
+    printf("negation kernel: %s, difference kernel: %s, lookup kernel: %s, %d iterations after %d warmup runs\n",
+           negate_bytes_implementation(), measure_differences_implementation(), lookup_pixels_implementation(),
+           options.iterations, options.warmup);
+    printf("%-14s %13s %3s %9s %9s %9s %9s %10s %9s\n", "stage", "size", "bpp", "min ms", "p50 ms", "p90 ms",
+           "max ms", "MB/s", "MP/s");
+    for (int i = 0; i < options.sizes_count; i++) {
+        if (run_case(options.widths[i], options.heights[i], 8, &options, times)
+            || run_case(options.widths[i], options.heights[i], 24, &options, times)) {
+            free(times);
+            return -1;
+        }
+    }
+    free(times);
+    return 0;
+}
@@ -2,13 +2,26 @@
 // Created by Alexander Fedkin on 03.11.2020.
 //
 
+#define _GNU_SOURCE
 #include "bmp_handler.h"
+#include "stats.h"
 #include <stdlib.h>
+#include <ctype.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #define BMP_PALETTE_SIZE_8bpp (256 * 4)
+#define BMP_PALETTE_SIZE_4bpp (16 * 4)
 #define HEADER_BYTES_SIZE 54
+#define BMPv3_POOL_SIZE 4
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
 
-static BMPv3_STATUS BMP_LAST_ERROR_CODE = BMPv3_OK;
+static __thread BMPv3_STATUS BMP_LAST_ERROR_CODE = BMPv3_OK;
 
 static const char* BMP_ERRORS[] = {
         "",
@@ -22,86 +35,264 @@ static const char* BMP_ERRORS[] = {
         "The requested action is not compatible with the BMP's type"
 };
 
-const char* BMP_get_error_description() {
-    if (BMP_LAST_ERROR_CODE > 0 && BMP_LAST_ERROR_CODE < BMPv3_ERROR_NUM) {
-        return BMP_ERRORS[BMP_LAST_ERROR_CODE];
+const char* BMP_get_status_description(BMPv3_STATUS status) {
+    if (status > 0 && status < BMPv3_ERROR_NUM) {
+        return BMP_ERRORS[status];
     } else {
         return NULL;
     }
 }
 
+const char* BMP_get_error_description() {
+    return BMP_get_status_description(BMP_LAST_ERROR_CODE);
+}
+
+static BMPv3_STATUS check_header(BMPv3* bmp) {
+    if (bmp->header.magic != 0x4D42 || bmp->header.width <= 0) {
+        return BMPv3_FILE_INVALID;
+    }
+    if ((bmp->header.bits_per_pixel != 32 && bmp->header.bits_per_pixel != 24
+         && bmp->header.bits_per_pixel != 8 && bmp->header.bits_per_pixel != 4)
+         || bmp->header.compression_type != 0 || bmp->header.header_size != 40) {
+        return BMPv3_FILE_NOT_SUPPORTED;
+    }
+    return BMPv3_OK;
+}
+
+long int get_BMPv3_palette_size(BMPv3* bmp) {
+    if (bmp->header.bits_per_pixel == 8) {
+        return BMP_PALETTE_SIZE_8bpp;
+    }
+    if (bmp->header.bits_per_pixel == 4) {
+        return BMP_PALETTE_SIZE_4bpp;
+    }
+    return 0;
+}
+
+/* Objects handed back with BMPv3_reuse, together with their palette and pixel buffers.
+   Guarded by a mutex because batch mode reads the next file on a second thread. */
+static struct {
+    pthread_mutex_t lock;
+    BMPv3* objects[BMPv3_POOL_SIZE];
+    int count;
+    int huge_pages;
+    int aligned_rows;
+} BMPv3_POOL = {PTHREAD_MUTEX_INITIALIZER, {NULL}, 0, 0, 0};
+
+void BMPv3_use_huge_pages(int enabled) {
+    pthread_mutex_lock(&BMPv3_POOL.lock);
+    BMPv3_POOL.huge_pages = enabled;
+    pthread_mutex_unlock(&BMPv3_POOL.lock);
+}
+
+void BMPv3_use_aligned_rows(int enabled) {
+    pthread_mutex_lock(&BMPv3_POOL.lock);
+    BMPv3_POOL.aligned_rows = enabled;
+    pthread_mutex_unlock(&BMPv3_POOL.lock);
+}
+
+static int use_aligned_rows() {
+    pthread_mutex_lock(&BMPv3_POOL.lock);
+    int aligned_rows = BMPv3_POOL.aligned_rows;
+    pthread_mutex_unlock(&BMPv3_POOL.lock);
+    return aligned_rows;
+}
+
+static void free_pixel_buffer(BMPv3* bmp) {
+    if (bmp->huge_pages) {
+        munmap(bmp->data, bmp->data_capacity);
+    } else {
+        free(bmp->data);
+    }
+    bmp->data = NULL;
+    bmp->data_capacity = 0;
+    bmp->huge_pages = 0;
+}
+
+static void allocate_pixel_buffer(BMPv3* bmp, size_t size, int huge_pages) {
+    if (huge_pages && size >= HUGE_PAGE_SIZE) {
+        size_t capacity = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        void* data = MAP_FAILED;
+#ifdef MAP_HUGETLB
+        data = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+        if (data == MAP_FAILED) {
+            /* No reserved huge pages: ask for transparent ones instead. */
+            data = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_HUGEPAGE
+            if (data != MAP_FAILED) {
+                madvise(data, capacity, MADV_HUGEPAGE);
+            }
+#endif
+        }
+        if (data != MAP_FAILED) {
+            bmp->data = (unsigned char*)data;
+            bmp->data_capacity = capacity;
+            bmp->huge_pages = 1;
+            return;
+        }
+    }
+    void* data = NULL;
+    if (posix_memalign(&data, BMPv3_ROW_ALIGNMENT, size > 0 ? size : 1) != 0) {
+        data = NULL;
+    }
+    bmp->data = (unsigned char*)data;
+    bmp->data_capacity = bmp->data != NULL ? size : 0;
+    bmp->huge_pages = 0;
+}
+
+/* Makes bmp->data hold at least size bytes. A buffer that is too small is swapped for the
+   smallest large enough one among the pooled objects before anything new is allocated. */
+static BMPv3_STATUS reserve_pixel_buffer(BMPv3* bmp, size_t size) {
+    BMPv3* best = NULL;
+    if (bmp->data != NULL && bmp->data_capacity >= size) {
+        return BMPv3_OK;
+    }
+    pthread_mutex_lock(&BMPv3_POOL.lock);
+    for (int i = 0; i < BMPv3_POOL.count; i++) {
+        BMPv3* pooled = BMPv3_POOL.objects[i];
+        if (pooled->data != NULL && pooled->data_capacity >= size
+            && (best == NULL || pooled->data_capacity < best->data_capacity)) {
+            best = pooled;
+        }
+    }
+    if (best != NULL) {
+        unsigned char* data = best->data;
+        size_t capacity = best->data_capacity;
+        int huge_pages = best->huge_pages;
+        best->data = bmp->data;
+        best->data_capacity = bmp->data_capacity;
+        best->huge_pages = bmp->huge_pages;
+        bmp->data = data;
+        bmp->data_capacity = capacity;
+        bmp->huge_pages = huge_pages;
+    }
+    int huge_pages = BMPv3_POOL.huge_pages;
+    pthread_mutex_unlock(&BMPv3_POOL.lock);
+    if (best != NULL) {
+        return BMPv3_OK;
+    }
+    free_pixel_buffer(bmp);
+    allocate_pixel_buffer(bmp, size, huge_pages);
+    return bmp->data != NULL ? BMPv3_OK : BMPv3_OUT_OF_MEMORY;
+}
+
+BMPv3* BMPv3_create() {
+    BMPv3* bmp = NULL;
+    pthread_mutex_lock(&BMPv3_POOL.lock);
+    if (BMPv3_POOL.count > 0) {
+        bmp = BMPv3_POOL.objects[--BMPv3_POOL.count];
+    }
+    pthread_mutex_unlock(&BMPv3_POOL.lock);
+    if (bmp == NULL) {
+        bmp = (BMPv3*)calloc(1, sizeof(BMPv3));
+    }
+    return bmp;
+}
+
+void BMPv3_reuse(BMPv3* bmp) {
+    if (bmp == NULL) {
+        return;
+    }
+    if (bmp->mapping != NULL) {
+        unmap_BMPv3_file(bmp);
+        return;
+    }
+    pthread_mutex_lock(&BMPv3_POOL.lock);
+    if (BMPv3_POOL.count < BMPv3_POOL_SIZE) {
+        BMPv3_POOL.objects[BMPv3_POOL.count++] = bmp;
+        bmp = NULL;
+    }
+    pthread_mutex_unlock(&BMPv3_POOL.lock);
+    BMPv3_free(bmp);
+}
+
+void BMPv3_pool_clear() {
+    BMPv3* objects[BMPv3_POOL_SIZE];
+    int count;
+    pthread_mutex_lock(&BMPv3_POOL.lock);
+    count = BMPv3_POOL.count;
+    memcpy(objects, BMPv3_POOL.objects, count * sizeof(BMPv3*));
+    BMPv3_POOL.count = 0;
+    pthread_mutex_unlock(&BMPv3_POOL.lock);
+    for (int i = 0; i < count; i++) {
+        BMPv3_free(objects[i]);
+    }
+}
+
 BMPv3* read_BMPv3_file(char* filename) {
     BMPv3* bmp;
-    FILE* f;
-    long int palette_size = 0;
     if (filename == NULL) {
         BMP_LAST_ERROR_CODE = BMPv3_INVALID_ARGUMENT;
         return NULL;
     }
-    bmp = (BMPv3*)calloc(1, sizeof(BMPv3));
+    bmp = BMPv3_create();
     if (bmp == NULL) {
         BMP_LAST_ERROR_CODE = BMPv3_OUT_OF_MEMORY;
         return NULL;
     }
-    f = fopen(filename, "rb");
-    if (f == NULL) {
-        BMP_LAST_ERROR_CODE = BMPv3_FILE_NOT_FOUND;
-        free(bmp);
-        return NULL;
-    }
-    if (read_header(bmp, f) != BMPv3_OK || bmp->header.magic != 0x4D42) {
-        BMP_LAST_ERROR_CODE = BMPv3_FILE_INVALID;
-        fclose(f);
-        free(bmp);
+    if (read_BMPv3_file_into(bmp, filename) != BMPv3_OK) {
+        BMPv3_STATUS status = BMP_LAST_ERROR_CODE;
+        BMPv3_reuse(bmp);
+        BMP_LAST_ERROR_CODE = status;
         return NULL;
     }
-    if (bmp->header.bits_per_pixel == 8) {
-        palette_size = BMP_PALETTE_SIZE_8bpp;
+    return bmp;
+}
+
+/* Moves the rows read back to back at row_size apart to stride apart, last row first so that
+   no row is overwritten before it is moved, and zeroes the padding after each of them. */
+static void spread_rows(unsigned char* data, long int row_size, long int stride, long int height) {
+    for (long int y = height - 1; y >= 0; y--) {
+        memmove(data + y * stride, data + y * row_size, row_size);
+        memset(data + y * stride + row_size, 0, stride - row_size);
     }
-    if ((bmp->header.bits_per_pixel != 24 && bmp->header.bits_per_pixel != 8)
-         || bmp->header.compression_type != 0 || bmp->header.header_size != 40) {
-        BMP_LAST_ERROR_CODE = BMPv3_FILE_NOT_SUPPORTED;
-        fclose(f);
-        free(bmp);
-        return NULL;
+}
+
+BMPv3_STATUS read_BMPv3_file_into(BMPv3* bmp, char* filename) {
+    FILE* f = open_BMPv3_file(bmp, filename);
+    long int row_size, height;
+    size_t size;
+    if (f == NULL) {
+        return BMP_LAST_ERROR_CODE;
     }
-    if (palette_size > 0) {
-        bmp->palette = (unsigned char*)malloc(palette_size * sizeof(unsigned char));
-        if (bmp->palette == NULL) {
-            BMP_LAST_ERROR_CODE = BMPv3_OUT_OF_MEMORY;
-            fclose(f);
-            free(bmp);
-            return NULL;
-        }
-        if (fread(bmp->palette, sizeof(unsigned char), palette_size, f) != palette_size) {
-            BMP_LAST_ERROR_CODE = BMPv3_FILE_INVALID;
-            fclose(f);
-            free(bmp->palette);
-            free(bmp);
-            return NULL;
-        }
-    } else {
-        bmp->palette = NULL;
+    row_size = get_BMPv3_row_size(bmp);
+    height = labs(bmp->header.height);
+    bmp->stride = row_size;
+    /* Rows can only be spread when the pixel data is exactly the rows, with nothing after them. */
+    if (use_aligned_rows() && row_size * height == bmp->header.image_data_size) {
+        bmp->stride = (row_size + BMPv3_ROW_ALIGNMENT - 1) / BMPv3_ROW_ALIGNMENT * BMPv3_ROW_ALIGNMENT;
     }
-    bmp->data = (unsigned char*)malloc(bmp->header.image_data_size);
-    if (bmp->data == NULL) {
-        BMP_LAST_ERROR_CODE = BMPv3_OUT_OF_MEMORY;
+    size = bmp->stride * height > bmp->header.image_data_size
+           ? bmp->stride * height : bmp->header.image_data_size;
+    if (reserve_pixel_buffer(bmp, size) != BMPv3_OK) {
         fclose(f);
-        free(bmp->palette);
-        free(bmp);
-        return NULL;
+        return BMP_LAST_ERROR_CODE = BMPv3_OUT_OF_MEMORY;
     }
+    STATS_SCOPE(STATS_READ);
     if (fread(bmp->data, sizeof(unsigned char), bmp->header.image_data_size, f) != bmp->header.image_data_size) {
-        BMP_LAST_ERROR_CODE = BMPv3_FILE_INVALID;
         fclose(f);
-        free(bmp->data);
-        free(bmp->palette);
-        free(bmp);
-        return NULL;
+        return BMP_LAST_ERROR_CODE = BMPv3_FILE_INVALID;
     }
     fclose(f);
-    BMP_LAST_ERROR_CODE = BMPv3_OK;
-    return bmp;
+    if (bmp->stride != row_size) {
+        spread_rows(bmp->data, row_size, bmp->stride, height);
+    }
+    STATS_COUNT(STATS_READ, bmp->header.image_data_size);
+    return BMP_LAST_ERROR_CODE = BMPv3_OK;
+}
+
+void BMPv3_free(BMPv3* bmp) {
+    if (bmp == NULL) {
+        return;
+    }
+    if (bmp->mapping != NULL) {
+        unmap_BMPv3_file(bmp);
+        return;
+    }
+    free_pixel_buffer(bmp);
+    free(bmp->palette);
+    free(bmp);
 }
 
 long int get_4byte_int(short first_byte_index, unsigned char* header_bytes) {
@@ -110,6 +301,13 @@ long int get_4byte_int(short first_byte_index, unsigned char* header_bytes) {
     return x;
 }
 
+long int get_4byte_uint(short first_byte_index, unsigned char* header_bytes) {
+    short i = first_byte_index;
+    long int x = (unsigned long int)header_bytes[i + 3] << 24 | header_bytes[i + 2] << 16
+                 | header_bytes[i + 1] << 8 | header_bytes[i];
+    return x;
+}
+
 short get_2byte_int(short first_byte_index, unsigned char* header_bytes) {
     short i = first_byte_index;
     short x = header_bytes[i + 1] << 8 | header_bytes[i];
@@ -130,39 +328,60 @@ void write_2byte_hex(short x, short first_element_index, unsigned char* array_of
     array_of_bytes[i] = (unsigned char)((x & 0x00ff) >> 0);
 }
 
-int	read_header(BMPv3* bmp, FILE* f) {
-    if (bmp == NULL || f == NULL) {
-        return BMPv3_INVALID_ARGUMENT;
-    }
-    unsigned char header_bytes[HEADER_BYTES_SIZE];
-    if (fread(header_bytes, HEADER_BYTES_SIZE, 1, f) != 1) {
-        return BMPv3_IO_ERROR;
-    }
+static void decode_header(BMPv3* bmp, unsigned char* header_bytes) {
     bmp->header.magic = get_2byte_int(0, header_bytes);
-    bmp->header.file_size  = get_4byte_int(2, header_bytes);
+    bmp->header.file_size = get_4byte_uint(2, header_bytes);
     bmp->header.reserved1 = get_2byte_int(6, header_bytes);
     bmp->header.reserved2 = get_2byte_int(8, header_bytes);
-    bmp->header.data_offset = get_4byte_int(10, header_bytes);
+    bmp->header.data_offset = get_4byte_uint(10, header_bytes);
     bmp->header.header_size = get_4byte_int(14, header_bytes);
     bmp->header.width = get_4byte_int(18, header_bytes);
     bmp->header.height = get_4byte_int(22, header_bytes);
     bmp->header.planes = get_2byte_int(26, header_bytes);
     bmp->header.bits_per_pixel = get_2byte_int(28, header_bytes);
     bmp->header.compression_type = get_4byte_int(30, header_bytes);
-    bmp->header.image_data_size = get_4byte_int(34, header_bytes);
+    bmp->header.image_data_size = get_4byte_uint(34, header_bytes);
     bmp->header.h_pixels_per_meter = get_4byte_int(38, header_bytes);
     bmp->header.v_pixels_per_meter = get_4byte_int(42, header_bytes);
     bmp->header.colors_used = get_4byte_int(46, header_bytes);
     bmp->header.colors_required = get_4byte_int(50, header_bytes);
+}
+
+static void encode_header(BMPv3* bmp, unsigned char* array_of_bytes) {
+    write_2byte_hex(bmp->header.magic, 0, array_of_bytes);
+    write_4byte_hex(bmp->header.file_size, 2, array_of_bytes);
+    write_2byte_hex(bmp->header.reserved1, 6, array_of_bytes);
+    write_2byte_hex(bmp->header.reserved2, 8, array_of_bytes);
+    write_4byte_hex(bmp->header.data_offset, 10, array_of_bytes);
+    write_4byte_hex(bmp->header.header_size, 14, array_of_bytes);
+    write_4byte_hex(bmp->header.width, 18, array_of_bytes);
+    write_4byte_hex(bmp->header.height, 22, array_of_bytes);
+    write_2byte_hex(bmp->header.planes, 26, array_of_bytes);
+    write_2byte_hex(bmp->header.bits_per_pixel, 28, array_of_bytes);
+    write_4byte_hex(bmp->header.compression_type, 30, array_of_bytes);
+    write_4byte_hex(bmp->header.image_data_size, 34, array_of_bytes);
+    write_4byte_hex(bmp->header.h_pixels_per_meter, 38, array_of_bytes);
+    write_4byte_hex(bmp->header.v_pixels_per_meter, 42, array_of_bytes);
+    write_4byte_hex(bmp->header.colors_used, 46, array_of_bytes);
+    write_4byte_hex(bmp->header.colors_required, 50, array_of_bytes);
+}
+
+int	read_header(BMPv3* bmp, FILE* f) {
+    if (bmp == NULL || f == NULL) {
+        return BMPv3_INVALID_ARGUMENT;
+    }
+    unsigned char header_bytes[HEADER_BYTES_SIZE];
+    if (fread(header_bytes, HEADER_BYTES_SIZE, 1, f) != 1) {
+        return BMPv3_IO_ERROR;
+    }
+    decode_header(bmp, header_bytes);
     return BMPv3_OK;
 }
 
 void write_BMPv3_file(BMPv3* bmp, char* filename) {
+    STATS_SCOPE(STATS_WRITE);
     FILE* f;
-    long int palette_size = 0;
-    if (bmp->header.bits_per_pixel == 8) {
-        palette_size = BMP_PALETTE_SIZE_8bpp;
-    }
+    long int palette_size = get_BMPv3_palette_size(bmp);
     if (filename == NULL) {
         BMP_LAST_ERROR_CODE = BMPv3_INVALID_ARGUMENT;
         return;
@@ -184,13 +403,25 @@ void write_BMPv3_file(BMPv3* bmp, char* filename) {
             return;
         }
     }
-    if (fwrite(bmp->data, sizeof(unsigned char), bmp->header.image_data_size, f) != bmp->header.image_data_size) {
-        BMP_LAST_ERROR_CODE = BMPv3_IO_ERROR;
-        fclose(f);
-        return;
+    if (get_BMPv3_stride(bmp) == get_BMPv3_row_size(bmp)) {
+        if (fwrite(bmp->data, sizeof(unsigned char), bmp->header.image_data_size, f) != bmp->header.image_data_size) {
+            BMP_LAST_ERROR_CODE = BMPv3_IO_ERROR;
+            fclose(f);
+            return;
+        }
+    } else {
+        long int row_size = get_BMPv3_row_size(bmp);
+        for (BMPv3_Row_Iterator rows = BMPv3_first_row(bmp); rows.y < rows.height; BMPv3_next_row(&rows)) {
+            if (fwrite(rows.row, sizeof(unsigned char), row_size, f) != row_size) {
+                BMP_LAST_ERROR_CODE = BMPv3_IO_ERROR;
+                fclose(f);
+                return;
+            }
+        }
     }
     BMP_LAST_ERROR_CODE = BMPv3_OK;
     fclose(f);
+    STATS_COUNT(STATS_WRITE, get_BMPv3_data_offset(bmp) + bmp->header.image_data_size);
 }
 
 int write_header(BMPv3* bmp, FILE* f) {
@@ -198,22 +429,7 @@ int write_header(BMPv3* bmp, FILE* f) {
         return BMPv3_INVALID_ARGUMENT;
     }
     unsigned char array_of_bytes[HEADER_BYTES_SIZE];
-    write_2byte_hex(bmp->header.magic, 0, array_of_bytes);
-    write_4byte_hex(bmp->header.file_size, 2, array_of_bytes);
-    write_2byte_hex(bmp->header.reserved1, 6, array_of_bytes);
-    write_2byte_hex(bmp->header.reserved2, 8, array_of_bytes);
-    write_4byte_hex(bmp->header.data_offset, 10, array_of_bytes);
-    write_4byte_hex(bmp->header.header_size, 14, array_of_bytes);
-    write_4byte_hex(bmp->header.width, 18, array_of_bytes);
-    write_4byte_hex(bmp->header.height, 22, array_of_bytes);
-    write_2byte_hex(bmp->header.planes, 26, array_of_bytes);
-    write_2byte_hex(bmp->header.bits_per_pixel, 28, array_of_bytes);
-    write_4byte_hex(bmp->header.compression_type, 30, array_of_bytes);
-    write_4byte_hex(bmp->header.image_data_size, 34, array_of_bytes);
-    write_4byte_hex(bmp->header.h_pixels_per_meter, 38, array_of_bytes);
-    write_4byte_hex(bmp->header.v_pixels_per_meter, 42, array_of_bytes);
-    write_4byte_hex(bmp->header.colors_used, 46, array_of_bytes);
-    write_4byte_hex(bmp->header.colors_required, 50, array_of_bytes);
+    encode_header(bmp, array_of_bytes);
     if (fwrite(array_of_bytes, HEADER_BYTES_SIZE, 1, f) != 1) {
         return BMPv3_IO_ERROR;
     }
@@ -223,4 +439,435 @@ int write_header(BMPv3* bmp, FILE* f) {
 BMPv3_STATUS BMP_get_error()
 {
     return BMP_LAST_ERROR_CODE;
-}
\ No newline at end of file
+}
+
+BMPv3* map_BMPv3_file(char* filename) {
+    STATS_SCOPE(STATS_OPEN);
+    BMPv3* bmp;
+    struct stat file_info;
+    int fd;
+    long int palette_size;
+    if (filename == NULL) {
+        BMP_LAST_ERROR_CODE = BMPv3_INVALID_ARGUMENT;
+        return NULL;
+    }
+    bmp = (BMPv3*)calloc(1, sizeof(BMPv3));
+    if (bmp == NULL) {
+        BMP_LAST_ERROR_CODE = BMPv3_OUT_OF_MEMORY;
+        return NULL;
+    }
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        BMP_LAST_ERROR_CODE = BMPv3_FILE_NOT_FOUND;
+        free(bmp);
+        return NULL;
+    }
+    if (fstat(fd, &file_info) != 0 || file_info.st_size < HEADER_BYTES_SIZE) {
+        BMP_LAST_ERROR_CODE = BMPv3_FILE_INVALID;
+        close(fd);
+        free(bmp);
+        return NULL;
+    }
+    bmp->mapping_size = file_info.st_size;
+    bmp->mapping = mmap(NULL, bmp->mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (bmp->mapping == MAP_FAILED) {
+        BMP_LAST_ERROR_CODE = BMPv3_IO_ERROR;
+        free(bmp);
+        return NULL;
+    }
+    decode_header(bmp, (unsigned char*)bmp->mapping);
+    if ((BMP_LAST_ERROR_CODE = check_header(bmp)) != BMPv3_OK) {
+        unmap_BMPv3_file(bmp);
+        return NULL;
+    }
+    palette_size = get_BMPv3_palette_size(bmp);
+    if (bmp->header.image_data_size < 0
+        || HEADER_BYTES_SIZE + palette_size + bmp->header.image_data_size > bmp->mapping_size) {
+        BMP_LAST_ERROR_CODE = BMPv3_FILE_INVALID;
+        unmap_BMPv3_file(bmp);
+        return NULL;
+    }
+    madvise(bmp->mapping, bmp->mapping_size, MADV_SEQUENTIAL);
+    bmp->palette = palette_size > 0 ? (unsigned char*)bmp->mapping + HEADER_BYTES_SIZE : NULL;
+    bmp->data = (unsigned char*)bmp->mapping + HEADER_BYTES_SIZE + palette_size;
+    bmp->stride = get_BMPv3_row_size(bmp);
+    BMP_LAST_ERROR_CODE = BMPv3_OK;
+    return bmp;
+}
+
+BMPv3* create_mapped_BMPv3_file(BMPv3_Header* header, char* filename) {
+    STATS_SCOPE(STATS_WRITE);
+    BMPv3* bmp;
+    int fd;
+    long int palette_size;
+    if (header == NULL || filename == NULL || header->image_data_size < 0) {
+        BMP_LAST_ERROR_CODE = BMPv3_INVALID_ARGUMENT;
+        return NULL;
+    }
+    bmp = (BMPv3*)calloc(1, sizeof(BMPv3));
+    if (bmp == NULL) {
+        BMP_LAST_ERROR_CODE = BMPv3_OUT_OF_MEMORY;
+        return NULL;
+    }
+    bmp->header = *header;
+    palette_size = get_BMPv3_palette_size(bmp);
+    bmp->mapping_size = HEADER_BYTES_SIZE + palette_size + bmp->header.image_data_size;
+    fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        BMP_LAST_ERROR_CODE = BMPv3_IO_ERROR;
+        free(bmp);
+        return NULL;
+    }
+    if (ftruncate(fd, bmp->mapping_size) != 0) {
+        BMP_LAST_ERROR_CODE = BMPv3_IO_ERROR;
+        close(fd);
+        free(bmp);
+        return NULL;
+    }
+    bmp->mapping = mmap(NULL, bmp->mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (bmp->mapping == MAP_FAILED) {
+        BMP_LAST_ERROR_CODE = BMPv3_IO_ERROR;
+        free(bmp);
+        return NULL;
+    }
+    encode_header(bmp, (unsigned char*)bmp->mapping);
+    bmp->palette = palette_size > 0 ? (unsigned char*)bmp->mapping + HEADER_BYTES_SIZE : NULL;
+    bmp->data = (unsigned char*)bmp->mapping + HEADER_BYTES_SIZE + palette_size;
+    bmp->stride = get_BMPv3_row_size(bmp);
+    BMP_LAST_ERROR_CODE = BMPv3_OK;
+    return bmp;
+}
+
+void unmap_BMPv3_file(BMPv3* bmp) {
+    if (bmp == NULL) {
+        return;
+    }
+    if (bmp->mapping != NULL && munmap(bmp->mapping, bmp->mapping_size) != 0) {
+        BMP_LAST_ERROR_CODE = BMPv3_IO_ERROR;
+    }
+    free(bmp);
+}
+
+FILE* open_BMPv3_file(BMPv3* bmp, char* filename) {
+    STATS_SCOPE(STATS_OPEN);
+    FILE* f;
+    long int palette_size;
+    if (bmp == NULL || filename == NULL || bmp->mapping != NULL) {
+        BMP_LAST_ERROR_CODE = BMPv3_INVALID_ARGUMENT;
+        return NULL;
+    }
+    f = fopen(filename, "rb");
+    if (f == NULL) {
+        BMP_LAST_ERROR_CODE = BMPv3_FILE_NOT_FOUND;
+        return NULL;
+    }
+    if (read_header(bmp, f) != BMPv3_OK) {
+        BMP_LAST_ERROR_CODE = BMPv3_FILE_INVALID;
+        fclose(f);
+        return NULL;
+    }
+    if ((BMP_LAST_ERROR_CODE = check_header(bmp)) != BMPv3_OK) {
+        fclose(f);
+        return NULL;
+    }
+    palette_size = get_BMPv3_palette_size(bmp);
+    if (palette_size > 0) {
+        /* Always room for an 8 bpp palette, since the object may be reused for one after a 4 bpp image. */
+        if (bmp->palette == NULL) {
+            bmp->palette = (unsigned char*)malloc(BMP_PALETTE_SIZE_8bpp * sizeof(unsigned char));
+        }
+        if (bmp->palette == NULL) {
+            BMP_LAST_ERROR_CODE = BMPv3_OUT_OF_MEMORY;
+            fclose(f);
+            return NULL;
+        }
+        if (fread(bmp->palette, sizeof(unsigned char), palette_size, f) != palette_size) {
+            BMP_LAST_ERROR_CODE = BMPv3_FILE_INVALID;
+            fclose(f);
+            return NULL;
+        }
+    }
+    STATS_COUNT(STATS_OPEN, get_BMPv3_data_offset(bmp));
+    BMP_LAST_ERROR_CODE = BMPv3_OK;
+    return f;
+}
+
+long int get_BMPv3_data_offset(BMPv3* bmp) {
+    return HEADER_BYTES_SIZE + get_BMPv3_palette_size(bmp);
+}
+
+long int get_BMPv3_row_size(BMPv3* bmp) {
+    return (bmp->header.width * bmp->header.bits_per_pixel + 31) / 32 * 4;
+}
+
+long int get_BMPv3_stride(BMPv3* bmp) {
+    return bmp->stride > 0 ? bmp->stride : get_BMPv3_row_size(bmp);
+}
+
+unsigned char* get_BMPv3_row(BMPv3* bmp, long int y) {
+    return bmp->data + y * get_BMPv3_stride(bmp);
+}
+
+BMPv3_Row_Iterator BMPv3_first_row(BMPv3* bmp) {
+    BMPv3_Row_Iterator rows = {bmp->data, 0, labs(bmp->header.height), get_BMPv3_stride(bmp)};
+    return rows;
+}
+
+void BMPv3_next_row(BMPv3_Row_Iterator* rows) {
+    rows->row += rows->stride;
+    rows->y++;
+}
+
+/* Whole rows of about BMPv3_STREAM_BAND_SIZE bytes, but no more than the whole pixel data. */
+static long int get_band_size(BMPv3* bmp) {
+    long int row_size = get_BMPv3_row_size(bmp);
+    long int band_size = row_size > 0 && row_size < BMPv3_STREAM_BAND_SIZE
+                         ? BMPv3_STREAM_BAND_SIZE / row_size * row_size : row_size;
+    return band_size < bmp->header.image_data_size ? band_size : bmp->header.image_data_size;
+}
+
+/* The band transfers of stream_BMPv3_file and patch_BMPv3_file; each returns 1 when all bytes moved. */
+static int read_band(FILE* input, unsigned char* band, long int band_size) {
+    STATS_SCOPE(STATS_READ);
+    STATS_COUNT(STATS_READ, band_size);
+    return fread(band, sizeof(unsigned char), band_size, input) == band_size;
+}
+
+static int write_band(FILE* output, unsigned char* band, long int band_size) {
+    STATS_SCOPE(STATS_WRITE);
+    STATS_COUNT(STATS_WRITE, band_size);
+    return fwrite(band, sizeof(unsigned char), band_size, output) == band_size;
+}
+
+static int read_band_at(int fd, unsigned char* band, long int band_size, long int offset) {
+    STATS_SCOPE(STATS_READ);
+    STATS_COUNT(STATS_READ, band_size);
+    return pread(fd, band, band_size, offset) == band_size;
+}
+
+static int write_band_at(int fd, unsigned char* band, long int band_size, long int offset) {
+    STATS_SCOPE(STATS_WRITE);
+    STATS_COUNT(STATS_WRITE, band_size);
+    return pwrite(fd, band, band_size, offset) == band_size;
+}
+
+/* Copies size bytes starting at offset of input to the current position of output without
+   passing them through user space: copy_file_range first, then sendfile for file systems that
+   cannot do it, then a plain read and write loop as the last resort. */
+static BMPv3_STATUS copy_file_bytes(FILE* input, long int offset, FILE* output, long int size) {
+    STATS_SCOPE(STATS_WRITE);
+    STATS_COUNT(STATS_WRITE, size);
+    int input_fd = fileno(input);
+    int output_fd = fileno(output);
+    off_t input_offset = offset;
+    ssize_t copied = -1;
+    if (fflush(output) != 0) {
+        return BMPv3_IO_ERROR;
+    }
+    while (size > 0 && (copied = copy_file_range(input_fd, &input_offset, output_fd, NULL, size, 0)) > 0) {
+        size -= copied;
+    }
+    if (copied < 0) {
+        while (size > 0 && (copied = sendfile(output_fd, input_fd, &input_offset, size)) > 0) {
+            size -= copied;
+        }
+    }
+    if (copied < 0) {
+        unsigned char* buffer = (unsigned char*)malloc(BMPv3_STREAM_BAND_SIZE);
+        if (buffer == NULL) {
+            return BMPv3_OUT_OF_MEMORY;
+        }
+        while (size > 0) {
+            size_t chunk = size < BMPv3_STREAM_BAND_SIZE ? size : BMPv3_STREAM_BAND_SIZE;
+            copied = pread(input_fd, buffer, chunk, input_offset);
+            if (copied <= 0) {
+                break;
+            }
+            if (write(output_fd, buffer, copied) != copied) {
+                free(buffer);
+                return BMPv3_IO_ERROR;
+            }
+            input_offset += copied;
+            size -= copied;
+        }
+        free(buffer);
+    }
+    return size == 0 ? BMPv3_OK : BMPv3_FILE_INVALID;
+}
+
+void stream_BMPv3_file(char* input_filename, char* output_filename, BMPv3_Stream_Handler* handler) {
+    BMPv3 bmp;
+    FILE* input;
+    FILE* output;
+    unsigned char* band = NULL;
+    long int palette_size, band_size, remaining;
+    if (input_filename == NULL || output_filename == NULL || handler == NULL) {
+        BMP_LAST_ERROR_CODE = BMPv3_INVALID_ARGUMENT;
+        return;
+    }
+    memset(&bmp, 0, sizeof(BMPv3));
+    input = open_BMPv3_file(&bmp, input_filename);
+    if (input == NULL) {
+        return;
+    }
+    palette_size = get_BMPv3_palette_size(&bmp);
+    band_size = get_band_size(&bmp);
+    if (handler->process_band != NULL) {
+        band = (unsigned char*)malloc(band_size > 0 ? band_size : 1);
+        if (band == NULL) {
+            BMP_LAST_ERROR_CODE = BMPv3_OUT_OF_MEMORY;
+            free(bmp.palette);
+            fclose(input);
+            return;
+        }
+    }
+    output = fopen(output_filename, "wb");
+    if (output == NULL) {
+        BMP_LAST_ERROR_CODE = BMPv3_IO_ERROR;
+        free(band);
+        free(bmp.palette);
+        fclose(input);
+        return;
+    }
+    if (handler->prepare != NULL) {
+        handler->prepare(&bmp, handler->context);
+    }
+    BMP_LAST_ERROR_CODE = BMPv3_OK;
+    if (write_header(&bmp, output) != BMPv3_OK
+        || (palette_size > 0 && fwrite(bmp.palette, sizeof(unsigned char), palette_size, output) != palette_size)) {
+        BMP_LAST_ERROR_CODE = BMPv3_IO_ERROR;
+    }
+    if (band == NULL && BMP_LAST_ERROR_CODE == BMPv3_OK) {
+        BMP_LAST_ERROR_CODE = copy_file_bytes(input, get_BMPv3_data_offset(&bmp), output,
+                                              bmp.header.image_data_size);
+    }
+    for (remaining = bmp.header.image_data_size; band != NULL && remaining > 0 && BMP_LAST_ERROR_CODE == BMPv3_OK;
+         remaining -= band_size) {
+        if (band_size > remaining) {
+            band_size = remaining;
+        }
+        if (!read_band(input, band, band_size)) {
+            BMP_LAST_ERROR_CODE = BMPv3_FILE_INVALID;
+            break;
+        }
+        handler->process_band(band, band_size, handler->context);
+        if (!write_band(output, band, band_size)) {
+            BMP_LAST_ERROR_CODE = BMPv3_IO_ERROR;
+        }
+    }
+    free(band);
+    free(bmp.palette);
+    fclose(input);
+    if (fclose(output) != 0 && BMP_LAST_ERROR_CODE == BMPv3_OK) {
+        BMP_LAST_ERROR_CODE = BMPv3_IO_ERROR;
+    }
+}
+
+void patch_BMPv3_file(char* filename, BMPv3_Stream_Handler* handler) {
+    BMPv3 bmp;
+    unsigned char header_bytes[HEADER_BYTES_SIZE];
+    unsigned char* band = NULL;
+    struct stat file_info;
+    long int palette_size, band_size, offset, end;
+    int fd;
+    if (filename == NULL || handler == NULL) {
+        BMP_LAST_ERROR_CODE = BMPv3_INVALID_ARGUMENT;
+        return;
+    }
+    fd = open(filename, O_RDWR);
+    if (fd < 0) {
+        BMP_LAST_ERROR_CODE = BMPv3_FILE_NOT_FOUND;
+        return;
+    }
+    memset(&bmp, 0, sizeof(BMPv3));
+    if (pread(fd, header_bytes, HEADER_BYTES_SIZE, 0) != HEADER_BYTES_SIZE) {
+        BMP_LAST_ERROR_CODE = BMPv3_FILE_INVALID;
+        close(fd);
+        return;
+    }
+    decode_header(&bmp, header_bytes);
+    if ((BMP_LAST_ERROR_CODE = check_header(&bmp)) != BMPv3_OK) {
+        close(fd);
+        return;
+    }
+    /* The bands are written back where get_BMPv3_data_offset puts them, so a file with a gap before
+       its pixels or a palette of another size would be overwritten in the wrong place. */
+    if (bmp.header.data_offset != get_BMPv3_data_offset(&bmp)) {
+        BMP_LAST_ERROR_CODE = BMPv3_FILE_NOT_SUPPORTED;
+        close(fd);
+        return;
+    }
+    palette_size = get_BMPv3_palette_size(&bmp);
+    band_size = get_band_size(&bmp);
+    if (fstat(fd, &file_info) != 0 || file_info.st_size < get_BMPv3_data_offset(&bmp) + bmp.header.image_data_size) {
+        BMP_LAST_ERROR_CODE = BMPv3_FILE_INVALID;
+        close(fd);
+        return;
+    }
+    bmp.palette = palette_size > 0 ? (unsigned char*)malloc(palette_size) : NULL;
+    band = handler->process_band != NULL ? (unsigned char*)malloc(band_size > 0 ? band_size : 1) : NULL;
+    if ((palette_size > 0 && bmp.palette == NULL) || (handler->process_band != NULL && band == NULL)) {
+        BMP_LAST_ERROR_CODE = BMPv3_OUT_OF_MEMORY;
+    } else if (palette_size > 0 && pread(fd, bmp.palette, palette_size, HEADER_BYTES_SIZE) != palette_size) {
+        BMP_LAST_ERROR_CODE = BMPv3_FILE_INVALID;
+    } else {
+        BMP_LAST_ERROR_CODE = BMPv3_OK;
+        if (handler->prepare != NULL) {
+            handler->prepare(&bmp, handler->context);
+        }
+        if (palette_size > 0 && pwrite(fd, bmp.palette, palette_size, HEADER_BYTES_SIZE) != palette_size) {
+            BMP_LAST_ERROR_CODE = BMPv3_IO_ERROR;
+        }
+    }
+    offset = get_BMPv3_data_offset(&bmp);
+    end = offset + bmp.header.image_data_size;
+    for (; band != NULL && offset < end && BMP_LAST_ERROR_CODE == BMPv3_OK; offset += band_size) {
+        if (band_size > end - offset) {
+            band_size = end - offset;
+        }
+        if (!read_band_at(fd, band, band_size, offset)) {
+            BMP_LAST_ERROR_CODE = BMPv3_FILE_INVALID;
+            break;
+        }
+        handler->process_band(band, band_size, handler->context);
+        if (!write_band_at(fd, band, band_size, offset)) {
+            BMP_LAST_ERROR_CODE = BMPv3_IO_ERROR;
+        }
+    }
+    free(band);
+    free(bmp.palette);
+    if (close(fd) != 0 && BMP_LAST_ERROR_CODE == BMPv3_OK) {
+        BMP_LAST_ERROR_CODE = BMPv3_IO_ERROR;
+    }
+}
+
+int is_bmp_filename(char* filename) {
+    size_t length = strlen(filename);
+    return length > 4 && filename[length - 4] == '.' && tolower(filename[length - 3]) == 'b'
+           && tolower(filename[length - 2]) == 'm' && tolower(filename[length - 1]) == 'p';
+}
+
+BMPv3_STATUS probe_BMPv3_file(char* filename, BMPv3_Header* header) {
+    STATS_SCOPE(STATS_OPEN);
+    BMPv3 bmp;
+    FILE* f;
+    if (filename == NULL || header == NULL) {
+        return BMP_LAST_ERROR_CODE = BMPv3_INVALID_ARGUMENT;
+    }
+    f = fopen(filename, "rb");
+    if (f == NULL) {
+        return BMP_LAST_ERROR_CODE = BMPv3_FILE_NOT_FOUND;
+    }
+    setvbuf(f, NULL, _IONBF, 0);
+    memset(&bmp, 0, sizeof(BMPv3));
+    if (read_header(&bmp, f) != BMPv3_OK) {
+        BMP_LAST_ERROR_CODE = BMPv3_FILE_INVALID;
+    } else {
+        BMP_LAST_ERROR_CODE = check_header(&bmp);
+    }
+    fclose(f);
+    *header = bmp.header;
+    return BMP_LAST_ERROR_CODE;
+}
@@ -3,6 +3,7 @@
 //
 
 #include <stdio.h>
+#include <stddef.h>
 
 #ifndef HOMEWORK_4_BMP_HANDLER_H
 #define HOMEWORK_4_BMP_HANDLER_H
@@ -43,20 +44,129 @@ typedef struct BMPv3 {
     BMPv3_Header header;
     unsigned char* palette;
     unsigned char* data;
+    /* Bytes from the start of one stored row to the next: the file row size, or that size rounded
+       up to BMPv3_ROW_ALIGNMENT for images read with aligned rows. Zero means the file row size. */
+    long int stride;
+    size_t data_capacity;
+    int huge_pages;
+    void* mapping;
+    size_t mapping_size;
 } BMPv3;
 
+/* Pixel buffers start on this boundary, and so do the rows of images read with aligned rows. */
+#define BMPv3_ROW_ALIGNMENT 64
+
+/* Walks the stored rows in file order (bottom-up images store the bottom row first). */
+typedef struct BMPv3_row_iterator {
+    unsigned char* row;
+    long int y;
+    long int height;
+    long int stride;
+} BMPv3_Row_Iterator;
+
+/* Pixel data is streamed in bands of whole rows of about this many bytes. */
+#define BMPv3_STREAM_BAND_SIZE (4 * 1024 * 1024)
+
+typedef struct BMPv3_stream_handler {
+    /* Called once the header and palette are read, before they are written out; may edit both. */
+    void (*prepare)(BMPv3* bmp, void* context);
+    /* Called for every band of pixel data before it is written out; may edit it in place.
+       When NULL the pixel data is copied by the kernel and never reaches user space. */
+    void (*process_band)(unsigned char* band, size_t band_size, void* context);
+    void* context;
+} BMPv3_Stream_Handler;
+
+/* Reads the whole file into an object taken from the pool (see BMPv3_reuse) or a new one. */
 BMPv3* read_BMPv3_file(char* filename);
 
+/* Reads the file into an existing object, reusing its palette and data buffers when they are large enough. */
+BMPv3_STATUS read_BMPv3_file_into(BMPv3* bmp, char* filename);
+
+/* Releases a BMPv3 returned by read_BMPv3_file, map_BMPv3_file or create_mapped_BMPv3_file. */
+void BMPv3_free(BMPv3* bmp);
+
+/* Returns an empty object from the pool, or a new one, to be filled by read_BMPv3_file_into. */
+BMPv3* BMPv3_create();
+
+/* Hands an object back to the pool together with its palette and pixel buffers, so later reads
+   of images of the same or smaller size allocate nothing. Frees it once the pool is full. */
+void BMPv3_reuse(BMPv3* bmp);
+
+/* Frees every object held by the pool. */
+void BMPv3_pool_clear();
+
+/* Pixel buffers of 2 MB and more allocated from now on are backed by huge pages:
+   reserved ones if the system has any, transparent ones otherwise. Off by default. */
+void BMPv3_use_huge_pages(int enabled);
+
+/* Images read from now on keep every row at a multiple of BMPv3_ROW_ALIGNMENT bytes, with zeroed
+   padding after the file's own row bytes, so a kernel may run over whole rows padding included.
+   Only the file row bytes are written back. Off by default. */
+void BMPv3_use_aligned_rows(int enabled);
+
 void write_BMPv3_file(BMPv3* bmp, char* filename);
 
 int write_header(BMPv3* bmp, FILE* f);
 
+/* Maps the file read-only; palette and data point into the mapping and must not be written. */
+BMPv3* map_BMPv3_file(char* filename);
+
+/* Creates a file sized for the header, writes the header and maps it with MAP_SHARED,
+   so everything stored into palette and data goes straight to the file. */
+BMPv3* create_mapped_BMPv3_file(BMPv3_Header* header, char* filename);
+
+void unmap_BMPv3_file(BMPv3* bmp);
+
+/* Copies input to output band by band through handler; memory use does not depend on the image size. */
+void stream_BMPv3_file(char* input_filename, char* output_filename, BMPv3_Stream_Handler* handler);
+
+/* Runs handler over the file in place: the edited palette and bands are written back with pwrite
+   over the bytes they were read from. The header is never rewritten. A file too short for its
+   header, or whose pixels do not start right after the header and palette, is rejected before
+   anything is written. */
+void patch_BMPv3_file(char* filename, BMPv3_Stream_Handler* handler);
+
 int	read_header(BMPv3* bmp, FILE* f);
 
+/* Reads and validates the header and palette only (the palette buffer is allocated if it is NULL,
+   large enough for any supported palette, so a reused object can read a file of another depth).
+   The returned stream is positioned at the pixel data; pixels are not read. */
+FILE* open_BMPv3_file(BMPv3* bmp, char* filename);
+
+/* Offset of the pixel data in the file: pixels are stored right after the header and palette. */
+long int get_BMPv3_data_offset(BMPv3* bmp);
+
+/* Reads only the header, through an unbuffered stream. The header is filled in even when
+   the returned status says the file is not supported. */
+BMPv3_STATUS probe_BMPv3_file(char* filename, BMPv3_Header* header);
+
+/* Non-zero if the name ends with ".bmp" in any letter case. */
+int is_bmp_filename(char* filename);
+
+/* 64 bytes for 4 bpp and 1024 bytes for 8 bpp images; 24 and 32 bpp images have no palette. */
+long int get_BMPv3_palette_size(BMPv3* bmp);
+
+/* Bytes per stored row, including the padding to a multiple of 4 bytes. */
+long int get_BMPv3_row_size(BMPv3* bmp);
+
+/* Distance between stored rows of the object's pixel data. */
+long int get_BMPv3_stride(BMPv3* bmp);
+
+/* Stored row y, counted in file order. */
+unsigned char* get_BMPv3_row(BMPv3* bmp, long int y);
+
+BMPv3_Row_Iterator BMPv3_first_row(BMPv3* bmp);
+
+/* Moves to the next stored row; rows->y reaches rows->height past the last one. */
+void BMPv3_next_row(BMPv3_Row_Iterator* rows);
+
+/* The last error is tracked per thread. */
 BMPv3_STATUS BMP_get_error();
 
 const char* BMP_get_error_description();
 
+const char* BMP_get_status_description(BMPv3_STATUS status);
+
 #define BMP_ERROR_CHECK(output_file, return_value) \
 	if (BMP_get_error() != BMPv3_OK) \
 	{\
@@ -0,0 +1,215 @@
+#include "bmp_hash.h"
+#include "content_hash.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define error(...) (fprintf(stderr, __VA_ARGS__))
+#define SIDECAR_SUFFIX ".hash"
+#define SIDECAR_MAGIC "BMPHASH1"
+#define SIDECAR_MAGIC_SIZE 8
+#define SIDECAR_FIELDS_COUNT 10
+#define SIDECAR_HEADER_SIZE (SIDECAR_MAGIC_SIZE + 8 * SIDECAR_FIELDS_COUNT)
+
+/* Sidecar layout, little-endian 8-byte fields after the magic: file size, modification seconds,
+   modification nanoseconds, width, height, bits per pixel, tile rows, tiles count, palette hash,
+   image hash; then one 8-byte hash per tile. */
+
+static void put_bytes(unsigned long long int x, int size, unsigned char* bytes) {
+    for (int i = 0; i < size; i++) {
+        bytes[i] = (unsigned char)(x >> (8 * i));
+    }
+}
+
+static unsigned long long int get_bytes(int size, const unsigned char* bytes) {
+    unsigned long long int x = 0;
+    for (int i = size - 1; i >= 0; i--) {
+        x = x << 8 | bytes[i];
+    }
+    return x;
+}
+
+typedef struct {
+    BMPv3* bmp;
+    BMP_HASHES* hashes;
+    long int row_size;
+} HASH_JOB;
+
+static void hash_tiles(long int begin, long int end, void* context) {
+    HASH_JOB* job = (HASH_JOB*)context;
+    BMP_HASHES* hashes = job->hashes;
+    int top_down = job->bmp->header.height < 0;
+    for (long int tile = begin; tile < end; tile++) {
+        CONTENT_HASH_STATE state;
+        long int last_row = (tile + 1) * hashes->tile_rows < hashes->height
+                            ? (tile + 1) * hashes->tile_rows : hashes->height;
+        content_hash_begin(&state);
+        for (long int row = tile * hashes->tile_rows; row < last_row; row++) {
+            content_hash_update(&state, get_BMPv3_row(job->bmp, top_down ? hashes->height - row - 1 : row),
+                                job->row_size);
+        }
+        hashes->tile_hashes[tile] = content_hash_end(&state);
+    }
+}
+
+static unsigned long long hash_image(BMP_HASHES* hashes) {
+    CONTENT_HASH_STATE state;
+    unsigned char fields[4 * 8];
+    put_bytes(hashes->width, 8, fields);
+    put_bytes(hashes->height, 8, fields + 8);
+    put_bytes(hashes->bits_per_pixel, 8, fields + 16);
+    put_bytes(hashes->palette_hash, 8, fields + 24);
+    content_hash_begin(&state);
+    content_hash_update(&state, fields, sizeof(fields));
+    for (long int tile = 0; tile < hashes->tiles_count; tile++) {
+        unsigned char tile_hash[8];
+        put_bytes(hashes->tile_hashes[tile], 8, tile_hash);
+        content_hash_update(&state, tile_hash, 8);
+    }
+    return content_hash_end(&state);
+}
+
+int bmp_hash_image(BMPv3* bmp, Thread_Pool* pool, BMP_HASHES* hashes) {
+    HASH_JOB job = {bmp, hashes, ((long int)bmp->header.bits_per_pixel * bmp->header.width + 7) / 8};
+    memset(hashes, 0, sizeof(BMP_HASHES));
+    hashes->width = bmp->header.width;
+    hashes->height = labs(bmp->header.height);
+    hashes->bits_per_pixel = bmp->header.bits_per_pixel;
+    hashes->tile_rows = job.row_size > 0 && job.row_size < BMP_HASH_TILE_SIZE ? BMP_HASH_TILE_SIZE / job.row_size : 1;
+    hashes->tiles_count = (hashes->height + hashes->tile_rows - 1) / hashes->tile_rows;
+    hashes->tile_hashes = (unsigned long long*)malloc((hashes->tiles_count > 0 ? hashes->tiles_count : 1)
+                                                     * sizeof(unsigned long long));
+    if (hashes->tile_hashes == NULL) {
+        error("%s\n", "Could not allocate memory for the hashes");
+        return 1;
+    }
+    hashes->palette_hash = content_hash(bmp->palette, get_BMPv3_palette_size(bmp));
+    thread_pool_run(pool, hashes->tiles_count, 1, hash_tiles, &job);
+    hashes->image_hash = hash_image(hashes);
+    return 0;
+}
+
+static char* get_sidecar_filename(char* filename) {
+    char* sidecar_filename = (char*)malloc(strlen(filename) + sizeof(SIDECAR_SUFFIX));
+    if (sidecar_filename != NULL) {
+        strcpy(sidecar_filename, filename);
+        strcat(sidecar_filename, SIDECAR_SUFFIX);
+    }
+    return sidecar_filename;
+}
+
+static void put_file_stamp(struct stat* file_info, unsigned char* fields) {
+    put_bytes(file_info->st_size, 8, fields);
+    put_bytes(file_info->st_mtim.tv_sec, 8, fields + 8);
+    put_bytes(file_info->st_mtim.tv_nsec, 8, fields + 16);
+}
+
+int bmp_hash_save(char* filename, BMP_HASHES* hashes) {
+    unsigned char header[SIDECAR_HEADER_SIZE];
+    unsigned char* fields = header + SIDECAR_MAGIC_SIZE;
+    struct stat file_info;
+    int failed = 0;
+    if (stat(filename, &file_info) != 0) {
+        return 1;
+    }
+    char* sidecar_filename = get_sidecar_filename(filename);
+    if (sidecar_filename == NULL) {
+        return 1;
+    }
+    memcpy(header, SIDECAR_MAGIC, SIDECAR_MAGIC_SIZE);
+    put_file_stamp(&file_info, fields);
+    put_bytes(hashes->width, 8, fields + 24);
+    put_bytes(hashes->height, 8, fields + 32);
+    put_bytes(hashes->bits_per_pixel, 8, fields + 40);
+    put_bytes(hashes->tile_rows, 8, fields + 48);
+    put_bytes(hashes->tiles_count, 8, fields + 56);
+    put_bytes(hashes->palette_hash, 8, fields + 64);
+    put_bytes(hashes->image_hash, 8, fields + 72);
+    FILE* f = fopen(sidecar_filename, "wb");
+    if (f == NULL) {
+        free(sidecar_filename);
+        return 1;
+    }
+    failed = fwrite(header, SIDECAR_HEADER_SIZE, 1, f) != 1;
+    for (long int tile = 0; tile < hashes->tiles_count && !failed; tile++) {
+        unsigned char tile_hash[8];
+        put_bytes(hashes->tile_hashes[tile], 8, tile_hash);
+        failed = fwrite(tile_hash, 8, 1, f) != 1;
+    }
+    if (fclose(f) != 0 || failed) {
+        remove(sidecar_filename);
+        failed = 1;
+    }
+    free(sidecar_filename);
+    return failed;
+}
+
+/* The stored hashes are trusted only while the stamp matches and they hash to the stored image hash.
+   The tile count is checked against the sidecar's size before anything is allocated for it. */
+int bmp_hash_load(char* filename, BMP_HASHES* hashes) {
+    unsigned char header[SIDECAR_HEADER_SIZE];
+    unsigned char stamp[3 * 8];
+    unsigned char* fields = header + SIDECAR_MAGIC_SIZE;
+    struct stat file_info, sidecar_info;
+    memset(hashes, 0, sizeof(BMP_HASHES));
+    if (stat(filename, &file_info) != 0) {
+        return 1;
+    }
+    char* sidecar_filename = get_sidecar_filename(filename);
+    if (sidecar_filename == NULL) {
+        return 1;
+    }
+    FILE* f = fopen(sidecar_filename, "rb");
+    free(sidecar_filename);
+    if (f == NULL) {
+        return 1;
+    }
+    put_file_stamp(&file_info, stamp);
+    if (fstat(fileno(f), &sidecar_info) != 0 || sidecar_info.st_size < SIDECAR_HEADER_SIZE
+        || fread(header, SIDECAR_HEADER_SIZE, 1, f) != 1 || memcmp(header, SIDECAR_MAGIC, SIDECAR_MAGIC_SIZE) != 0
+        || memcmp(fields, stamp, sizeof(stamp)) != 0) {
+        fclose(f);
+        return 1;
+    }
+    hashes->width = (long int)get_bytes(8, fields + 24);
+    hashes->height = (long int)get_bytes(8, fields + 32);
+    hashes->bits_per_pixel = (short)get_bytes(8, fields + 40);
+    hashes->tile_rows = (long int)get_bytes(8, fields + 48);
+    hashes->tiles_count = (long int)get_bytes(8, fields + 56);
+    hashes->palette_hash = get_bytes(8, fields + 64);
+    hashes->image_hash = get_bytes(8, fields + 72);
+    if (hashes->tile_rows <= 0 || hashes->height < 0 || hashes->tiles_count < 0
+        || hashes->tiles_count != (sidecar_info.st_size - SIDECAR_HEADER_SIZE) / 8
+        || sidecar_info.st_size != SIDECAR_HEADER_SIZE + 8 * hashes->tiles_count
+        || hashes->tiles_count != hashes->height / hashes->tile_rows + (hashes->height % hashes->tile_rows != 0)) {
+        fclose(f);
+        return 1;
+    }
+    hashes->tile_hashes = (unsigned long long*)malloc((hashes->tiles_count > 0 ? hashes->tiles_count : 1)
+                                                     * sizeof(unsigned long long));
+    long int tile = 0;
+    for (; hashes->tile_hashes != NULL && tile < hashes->tiles_count; tile++) {
+        unsigned char tile_hash[8];
+        if (fread(tile_hash, 8, 1, f) != 1) {
+            break;
+        }
+        hashes->tile_hashes[tile] = get_bytes(8, tile_hash);
+    }
+    fclose(f);
+    if (hashes->tile_hashes == NULL || tile < hashes->tiles_count || hash_image(hashes) != hashes->image_hash) {
+        bmp_hash_free(hashes);
+        return 1;
+    }
+    return 0;
+}
+
+int bmp_hash_same_tiles(BMP_HASHES* first, BMP_HASHES* second) {
+    return first->width == second->width && first->height == second->height
+           && first->bits_per_pixel == second->bits_per_pixel && first->tile_rows == second->tile_rows;
+}
+
+void bmp_hash_free(BMP_HASHES* hashes) {
+    free(hashes->tile_hashes);
+    hashes->tile_hashes = NULL;
+    hashes->tiles_count = 0;
+}
@@ -0,0 +1,43 @@
+#include "bmp_handler.h"
+#include "thread_pool.h"
+
+#ifndef HOMEWORK_4_BMP_HASH_H
+#define HOMEWORK_4_BMP_HASH_H
+
+/* Pixel rows are hashed in tiles of whole rows holding about this many bytes. */
+#define BMP_HASH_TILE_SIZE (256 * 1024)
+
+/* Content hashes of an image. Tiles are counted from the bottom row whatever the row order of
+   the file, and hash the rows without their padding, so images with the same pixels stored
+   bottom-up and top-down get the same hashes. The image hash covers the size, the bits per
+   pixel, the palette and every tile hash. */
+typedef struct {
+    long int width;
+    long int height;
+    short bits_per_pixel;
+    long int tile_rows;
+    long int tiles_count;
+    unsigned long long palette_hash;
+    unsigned long long image_hash;
+    unsigned long long* tile_hashes;
+} BMP_HASHES;
+
+/* Hashes the tiles of the image spread over the pool. Returns 0 on success; otherwise prints
+   the problem to stderr and returns 1. */
+int bmp_hash_image(BMPv3* bmp, Thread_Pool* pool, BMP_HASHES* hashes);
+
+/* Stores the hashes in the sidecar file "<filename>.hash", stamped with the size and modification
+   time of the BMP file. Being a cache, it fails silently: returns 1 if the sidecar was not written. */
+int bmp_hash_save(char* filename, BMP_HASHES* hashes);
+
+/* Loads the sidecar of the BMP file if there is one and the file has not changed since it was
+   written. Returns 0 on success and 1 otherwise, without printing anything. */
+int bmp_hash_load(char* filename, BMP_HASHES* hashes);
+
+/* Non-zero if both images have the same size, bits per pixel and tiles, so their tiles can be
+   matched one to one. */
+int bmp_hash_same_tiles(BMP_HASHES* first, BMP_HASHES* second);
+
+void bmp_hash_free(BMP_HASHES* hashes);
+
+#endif //HOMEWORK_4_BMP_HASH_H
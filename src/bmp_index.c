@@ -0,0 +1,256 @@
+#include "bmp_index.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define error(...) (fprintf(stderr, __VA_ARGS__))
+#define INDEX_MAGIC "BMPINDX1"
+#define INDEX_MAGIC_SIZE 8
+#define INDEX_HEADER_SIZE (INDEX_MAGIC_SIZE + 8 + 8)
+#define RECORD_SIZE 24
+#define PROBE_TILE_SIZE 64
+
+/* Record layout, little-endian: name offset (8), width (4), height (4), data offset (4),
+   bits per pixel (2), status (1), padding (1). */
+struct bmp_index {
+    unsigned char* records;
+    char* names;
+    long int count;
+    long int records_capacity;
+    size_t names_size;
+    size_t names_capacity;
+    void* mapping;
+    size_t mapping_size;
+};
+
+static void put_bytes(unsigned long long int x, int size, unsigned char* bytes) {
+    for (int i = 0; i < size; i++) {
+        bytes[i] = (unsigned char)(x >> (8 * i));
+    }
+}
+
+static unsigned long long int get_bytes(int size, const unsigned char* bytes) {
+    unsigned long long int x = 0;
+    for (int i = size - 1; i >= 0; i--) {
+        x = x << 8 | bytes[i];
+    }
+    return x;
+}
+
+BMP_Index* bmp_index_create() {
+    return (BMP_Index*)calloc(1, sizeof(BMP_Index));
+}
+
+static int add_file(BMP_Index* index, char* filename) {
+    size_t length = strlen(filename) + 1;
+    if (index->count == index->records_capacity) {
+        long int capacity = index->records_capacity > 0 ? index->records_capacity * 2 : 1024;
+        unsigned char* records = (unsigned char*)realloc(index->records, capacity * RECORD_SIZE);
+        if (records == NULL) {
+            error("%s\n", "Could not allocate memory for the index");
+            return 1;
+        }
+        index->records = records;
+        index->records_capacity = capacity;
+    }
+    if (index->names_size + length > index->names_capacity) {
+        size_t capacity = index->names_capacity > 0 ? index->names_capacity * 2 : 64 * 1024;
+        while (capacity < index->names_size + length) {
+            capacity *= 2;
+        }
+        char* names = (char*)realloc(index->names, capacity);
+        if (names == NULL) {
+            error("%s\n", "Could not allocate memory for the index");
+            return 1;
+        }
+        index->names = names;
+        index->names_capacity = capacity;
+    }
+    unsigned char* record = index->records + index->count * RECORD_SIZE;
+    memset(record, 0, RECORD_SIZE);
+    put_bytes(index->names_size, 8, record);
+    record[22] = BMPv3_ERROR;
+    memcpy(index->names + index->names_size, filename, length);
+    index->names_size += length;
+    index->count++;
+    return 0;
+}
+
+static int add_directory(BMP_Index* index, char* path) {
+    struct dirent* entry;
+    DIR* directory = opendir(path);
+    if (directory == NULL) {
+        error("Could not open the directory %s\n", path);
+        return 1;
+    }
+    size_t path_length = strlen(path);
+    int result = 0;
+    while (result == 0 && (entry = readdir(directory)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        char* child = (char*)malloc(path_length + strlen(entry->d_name) + 2);
+        if (child == NULL) {
+            error("%s\n", "Could not allocate memory for the index");
+            result = 1;
+            break;
+        }
+        sprintf(child, path_length > 0 && path[path_length - 1] == '/' ? "%s%s" : "%s/%s", path, entry->d_name);
+        int is_directory = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+            struct stat child_info;
+            is_directory = stat(child, &child_info) == 0 && S_ISDIR(child_info.st_mode);
+        }
+        if (is_directory && entry->d_type != DT_LNK) {
+            result = add_directory(index, child);
+        } else if (!is_directory && is_bmp_filename(entry->d_name)) {
+            result = add_file(index, child);
+        }
+        free(child);
+    }
+    closedir(directory);
+    return result;
+}
+
+int bmp_index_add_path(BMP_Index* index, char* path) {
+    struct stat path_info;
+    if (index->mapping != NULL) {
+        error("%s\n", "A loaded index cannot be extended");
+        return 1;
+    }
+    if (stat(path, &path_info) != 0) {
+        error("Could not find %s\n", path);
+        return 1;
+    }
+    return S_ISDIR(path_info.st_mode) ? add_directory(index, path) : add_file(index, path);
+}
+
+static void probe_files(long int begin, long int end, void* context) {
+    BMP_Index* index = (BMP_Index*)context;
+    BMPv3_Header header;
+    for (long int i = begin; i < end; i++) {
+        unsigned char* record = index->records + i * RECORD_SIZE;
+        BMPv3_STATUS status = probe_BMPv3_file(index->names + get_bytes(8, record), &header);
+        if (status != BMPv3_OK && status != BMPv3_FILE_NOT_SUPPORTED) {
+            memset(&header, 0, sizeof(BMPv3_Header));
+        }
+        put_bytes(header.width, 4, record + 8);
+        put_bytes(header.height, 4, record + 12);
+        put_bytes(header.data_offset, 4, record + 16);
+        put_bytes(header.bits_per_pixel, 2, record + 20);
+        record[22] = (unsigned char)status;
+    }
+}
+
+void bmp_index_probe(BMP_Index* index, Thread_Pool* pool) {
+    if (index->mapping == NULL) {
+        thread_pool_run(pool, index->count, PROBE_TILE_SIZE, probe_files, index);
+    }
+}
+
+int bmp_index_save(BMP_Index* index, char* filename) {
+    unsigned char header[INDEX_HEADER_SIZE];
+    FILE* f = fopen(filename, "wb");
+    if (f == NULL) {
+        error("Could not create %s\n", filename);
+        return 1;
+    }
+    memcpy(header, INDEX_MAGIC, INDEX_MAGIC_SIZE);
+    put_bytes(index->count, 8, header + INDEX_MAGIC_SIZE);
+    put_bytes(index->names_size, 8, header + INDEX_MAGIC_SIZE + 8);
+    if (fwrite(header, INDEX_HEADER_SIZE, 1, f) != 1
+        || fwrite(index->records, RECORD_SIZE, index->count, f) != index->count
+        || fwrite(index->names, 1, index->names_size, f) != index->names_size
+        || fclose(f) != 0) {
+        error("Could not write %s\n", filename);
+        return 1;
+    }
+    return 0;
+}
+
+/* Checks the counts in the header against the size of the file, then every record's name offset
+   against the names, so that bmp_index_get never reads outside the mapping. */
+static int is_index_valid(BMP_Index* index) {
+    unsigned char* header = (unsigned char*)index->mapping;
+    size_t space = index->mapping_size - INDEX_HEADER_SIZE;
+    if (memcmp(header, INDEX_MAGIC, INDEX_MAGIC_SIZE) != 0 || index->count < 0
+        || (unsigned long int)index->count > space / RECORD_SIZE
+        || index->names_size != space - (size_t)index->count * RECORD_SIZE) {
+        return 0;
+    }
+    index->records = header + INDEX_HEADER_SIZE;
+    index->names = (char*)index->records + index->count * RECORD_SIZE;
+    if (index->names_size > 0 && index->names[index->names_size - 1] != '\0') {
+        return 0;
+    }
+    for (long int position = 0; position < index->count; position++) {
+        if (get_bytes(8, index->records + position * RECORD_SIZE) >= index->names_size) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+BMP_Index* bmp_index_load(char* filename) {
+    struct stat file_info;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        error("Could not open %s\n", filename);
+        return NULL;
+    }
+    BMP_Index* index = bmp_index_create();
+    if (index == NULL || fstat(fd, &file_info) != 0 || file_info.st_size < INDEX_HEADER_SIZE) {
+        error("%s is not a BMP index\n", filename);
+        free(index);
+        close(fd);
+        return NULL;
+    }
+    index->mapping_size = file_info.st_size;
+    index->mapping = mmap(NULL, index->mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (index->mapping == MAP_FAILED) {
+        error("Could not map %s\n", filename);
+        free(index);
+        return NULL;
+    }
+    unsigned char* header = (unsigned char*)index->mapping;
+    index->count = (long int)get_bytes(8, header + INDEX_MAGIC_SIZE);
+    index->names_size = get_bytes(8, header + INDEX_MAGIC_SIZE + 8);
+    if (!is_index_valid(index)) {
+        error("%s is not a BMP index\n", filename);
+        bmp_index_free(index);
+        return NULL;
+    }
+    return index;
+}
+
+long int bmp_index_size(BMP_Index* index) {
+    return index->count;
+}
+
+void bmp_index_get(BMP_Index* index, long int position, BMP_INDEX_ENTRY* entry) {
+    unsigned char* record = index->records + position * RECORD_SIZE;
+    entry->filename = index->names + get_bytes(8, record);
+    entry->width = (int)get_bytes(4, record + 8);
+    entry->height = (int)get_bytes(4, record + 12);
+    entry->data_offset = (long int)get_bytes(4, record + 16);
+    entry->bits_per_pixel = (short)get_bytes(2, record + 20);
+    entry->status = (BMPv3_STATUS)record[22];
+}
+
+void bmp_index_free(BMP_Index* index) {
+    if (index == NULL) {
+        return;
+    }
+    if (index->mapping != NULL) {
+        munmap(index->mapping, index->mapping_size);
+    } else {
+        free(index->records);
+        free(index->names);
+    }
+    free(index);
+}
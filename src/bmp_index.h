@@ -0,0 +1,40 @@
+#include "bmp_handler.h"
+#include "thread_pool.h"
+
+#ifndef HOMEWORK_4_BMP_INDEX_H
+#define HOMEWORK_4_BMP_INDEX_H
+
+typedef struct {
+    char* filename;
+    BMPv3_STATUS status;
+    long int width;
+    long int height;
+    short bits_per_pixel;
+    long int data_offset;
+} BMP_INDEX_ENTRY;
+
+/* Header metadata of many BMP files. On disk it is a fixed-size record per file followed by
+   all file names, so a saved index is mapped into memory on load instead of being parsed. */
+typedef struct bmp_index BMP_Index;
+
+BMP_Index* bmp_index_create();
+
+/* Adds a file, or every .bmp file found under a directory and its subdirectories.
+   Returns 0 on success; otherwise prints the problem to stderr and returns 1. */
+int bmp_index_add_path(BMP_Index* index, char* path);
+
+/* Reads the headers of all added files, spread over the pool. */
+void bmp_index_probe(BMP_Index* index, Thread_Pool* pool);
+
+int bmp_index_save(BMP_Index* index, char* filename);
+
+/* Maps an index written by bmp_index_save. Returns NULL (and prints the problem) on failure. */
+BMP_Index* bmp_index_load(char* filename);
+
+long int bmp_index_size(BMP_Index* index);
+
+void bmp_index_get(BMP_Index* index, long int position, BMP_INDEX_ENTRY* entry);
+
+void bmp_index_free(BMP_Index* index);
+
+#endif //HOMEWORK_4_BMP_INDEX_H
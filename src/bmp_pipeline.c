@@ -0,0 +1,428 @@
+#include "bmp_pipeline.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef BMP_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+#define HEADER_BYTES_SIZE 54
+
+typedef struct {
+    int input_fd;
+    int output_fd;
+    long int data_offset;
+    long int data_size;
+    long int band_size;
+    long int bands_count;
+    unsigned char* slots[BMPv3_PIPELINE_DEPTH];
+    BMPv3_Stream_Handler* handler;
+} PIPELINE;
+
+static long int get_band_length(PIPELINE* pipeline, long int band) {
+    long int rest = pipeline->data_size - band * pipeline->band_size;
+    return rest < pipeline->band_size ? rest : pipeline->band_size;
+}
+
+static BMPv3_STATUS read_band(PIPELINE* pipeline, long int band) {
+    unsigned char* slot = pipeline->slots[band % BMPv3_PIPELINE_DEPTH];
+    long int length = get_band_length(pipeline, band);
+    long int offset = pipeline->data_offset + band * pipeline->band_size;
+    for (long int done = 0; done < length;) {
+        ssize_t count = pread(pipeline->input_fd, slot + done, length - done, offset + done);
+        if (count <= 0) {
+            return BMPv3_FILE_INVALID;
+        }
+        done += count;
+    }
+    return BMPv3_OK;
+}
+
+static BMPv3_STATUS write_band(PIPELINE* pipeline, long int band) {
+    unsigned char* slot = pipeline->slots[band % BMPv3_PIPELINE_DEPTH];
+    long int length = get_band_length(pipeline, band);
+    long int offset = pipeline->data_offset + band * pipeline->band_size;
+    for (long int done = 0; done < length;) {
+        ssize_t count = pwrite(pipeline->output_fd, slot + done, length - done, offset + done);
+        if (count <= 0) {
+            return BMPv3_IO_ERROR;
+        }
+        done += count;
+    }
+    return BMPv3_OK;
+}
+
+static void process_band(PIPELINE* pipeline, long int band) {
+    pipeline->handler->process_band(pipeline->slots[band % BMPv3_PIPELINE_DEPTH],
+                                    get_band_length(pipeline, band), pipeline->handler->context);
+}
+
+/* Reader, processor and writer each advance their own counter; a band's slot is reused once
+   the band BMPv3_PIPELINE_DEPTH places before it is written. The first failure stops all three. */
+typedef struct {
+    PIPELINE* pipeline;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    long int read_count;
+    long int processed_count;
+    long int written_count;
+    BMPv3_STATUS status;
+} THREAD_PIPELINE;
+
+static void finish_stage(THREAD_PIPELINE* threads, long int* count, BMPv3_STATUS status) {
+    pthread_mutex_lock(&threads->lock);
+    if (status != BMPv3_OK) {
+        if (threads->status == BMPv3_OK) {
+            threads->status = status;
+        }
+    } else {
+        (*count)++;
+    }
+    pthread_cond_broadcast(&threads->changed);
+    pthread_mutex_unlock(&threads->lock);
+}
+
+/* Waits until the stage may start on band; returns 0 when the pipeline has failed. */
+static int wait_for_band(THREAD_PIPELINE* threads, long int* count, long int band, long int lag) {
+    pthread_mutex_lock(&threads->lock);
+    while (threads->status == BMPv3_OK && band - *count >= lag) {
+        pthread_cond_wait(&threads->changed, &threads->lock);
+    }
+    int go_on = threads->status == BMPv3_OK;
+    pthread_mutex_unlock(&threads->lock);
+    return go_on;
+}
+
+static void* read_bands(void* argument) {
+    THREAD_PIPELINE* threads = (THREAD_PIPELINE*)argument;
+    for (long int band = 0; band < threads->pipeline->bands_count; band++) {
+        if (!wait_for_band(threads, &threads->written_count, band, BMPv3_PIPELINE_DEPTH)) {
+            break;
+        }
+        finish_stage(threads, &threads->read_count, read_band(threads->pipeline, band));
+    }
+    return NULL;
+}
+
+static void* write_bands(void* argument) {
+    THREAD_PIPELINE* threads = (THREAD_PIPELINE*)argument;
+    for (long int band = 0; band < threads->pipeline->bands_count; band++) {
+        if (!wait_for_band(threads, &threads->processed_count, band, 0)) {
+            break;
+        }
+        finish_stage(threads, &threads->written_count, write_band(threads->pipeline, band));
+    }
+    return NULL;
+}
+
+static BMPv3_STATUS run_thread_pipeline(PIPELINE* pipeline) {
+    THREAD_PIPELINE threads = {pipeline, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0, BMPv3_OK};
+    pthread_t reader, writer;
+    if (pthread_create(&reader, NULL, read_bands, &threads) != 0) {
+        return BMPv3_OUT_OF_MEMORY;
+    }
+    if (pthread_create(&writer, NULL, write_bands, &threads) != 0) {
+        finish_stage(&threads, NULL, BMPv3_OUT_OF_MEMORY);
+        pthread_join(reader, NULL);
+        return BMPv3_OUT_OF_MEMORY;
+    }
+    for (long int band = 0; band < pipeline->bands_count; band++) {
+        if (!wait_for_band(&threads, &threads.read_count, band, 0)) {
+            break;
+        }
+        process_band(pipeline, band);
+        finish_stage(&threads, &threads.processed_count, BMPv3_OK);
+    }
+    pthread_join(reader, NULL);
+    pthread_join(writer, NULL);
+    return threads.status;
+}
+
+#ifdef BMP_HAVE_IO_URING
+
+typedef enum {
+    SLOT_READING,
+    SLOT_READ,
+    SLOT_WRITING
+} SLOT_STATE;
+
+/* One submission and one completion ring shared with the kernel, driven by raw system calls. */
+typedef struct {
+    int fd;
+    unsigned int* sq_tail;
+    unsigned int* sq_mask;
+    unsigned int* sq_array;
+    unsigned int* cq_head;
+    unsigned int* cq_tail;
+    unsigned int* cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned int to_submit;
+    unsigned int in_flight;
+    long int written_count;
+    long int bands[BMPv3_PIPELINE_DEPTH];
+    SLOT_STATE states[BMPv3_PIPELINE_DEPTH];
+    long int done[BMPv3_PIPELINE_DEPTH];
+    struct iovec vectors[BMPv3_PIPELINE_DEPTH];
+} URING;
+
+static void close_uring(URING* ring) {
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != NULL) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    close(ring->fd);
+}
+
+/* Returns 0 on success and 1 if the kernel does not let us use io_uring. */
+static int open_uring(URING* ring) {
+    struct io_uring_params parameters;
+    memset(ring, 0, sizeof(URING));
+    memset(&parameters, 0, sizeof(parameters));
+    ring->fd = (int)syscall(__NR_io_uring_setup, 2 * BMPv3_PIPELINE_DEPTH, &parameters);
+    if (ring->fd < 0) {
+        return 1;
+    }
+    ring->sq_ring_size = parameters.sq_off.array + parameters.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = parameters.cq_off.cqes + parameters.cq_entries * sizeof(struct io_uring_cqe);
+    if (parameters.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        close_uring(ring);
+        return 1;
+    }
+    if (parameters.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            close_uring(ring);
+            return 1;
+        }
+    }
+    ring->sqes_size = parameters.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                                            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        close_uring(ring);
+        return 1;
+    }
+    ring->sq_tail = (unsigned int*)((char*)ring->sq_ring + parameters.sq_off.tail);
+    ring->sq_mask = (unsigned int*)((char*)ring->sq_ring + parameters.sq_off.ring_mask);
+    ring->sq_array = (unsigned int*)((char*)ring->sq_ring + parameters.sq_off.array);
+    ring->cq_head = (unsigned int*)((char*)ring->cq_ring + parameters.cq_off.head);
+    ring->cq_tail = (unsigned int*)((char*)ring->cq_ring + parameters.cq_off.tail);
+    ring->cq_mask = (unsigned int*)((char*)ring->cq_ring + parameters.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)((char*)ring->cq_ring + parameters.cq_off.cqes);
+    return 0;
+}
+
+/* Queues the rest of the slot's read or write. At most one request per slot is ever queued,
+   so the submission ring, twice the pipeline depth, cannot overflow. */
+static void queue_slot(URING* ring, PIPELINE* pipeline, int slot) {
+    long int band = ring->bands[slot];
+    unsigned int tail = *ring->sq_tail;
+    unsigned int index = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    ring->vectors[slot].iov_base = pipeline->slots[slot] + ring->done[slot];
+    ring->vectors[slot].iov_len = get_band_length(pipeline, band) - ring->done[slot];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = ring->states[slot] == SLOT_WRITING ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = ring->states[slot] == SLOT_WRITING ? pipeline->output_fd : pipeline->input_fd;
+    sqe->off = pipeline->data_offset + band * pipeline->band_size + ring->done[slot];
+    sqe->addr = (unsigned long long int)(size_t)&ring->vectors[slot];
+    sqe->len = 1;
+    sqe->user_data = slot;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+    ring->in_flight++;
+}
+
+static void start_band(URING* ring, PIPELINE* pipeline, long int band, SLOT_STATE state) {
+    int slot = (int)(band % BMPv3_PIPELINE_DEPTH);
+    ring->bands[slot] = band;
+    ring->states[slot] = state;
+    ring->done[slot] = 0;
+    queue_slot(ring, pipeline, slot);
+}
+
+/* Submits everything queued and, if wait is set, blocks for at least one completion.
+   An interrupted or busy call is not an error: whatever was not submitted stays queued for the next one. */
+static BMPv3_STATUS enter_uring(URING* ring, int wait) {
+    long int result = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait ? 1 : 0,
+                              wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (result < 0) {
+        return errno == EINTR || errno == EAGAIN || errno == EBUSY ? BMPv3_OK : BMPv3_IO_ERROR;
+    }
+    ring->to_submit -= (unsigned int)result;
+    return BMPv3_OK;
+}
+
+/* Handles every completion posted so far: a finished read makes its band ready for processing,
+   a finished write refills its slot with the band BMPv3_PIPELINE_DEPTH places later, and a short
+   transfer is requeued. Writes may complete in any order, so only the slot just written is refilled. */
+static BMPv3_STATUS reap_completions(URING* ring, PIPELINE* pipeline, BMPv3_STATUS status) {
+    unsigned int head = *ring->cq_head;
+    unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+        int slot = (int)cqe->user_data;
+        int writing = ring->states[slot] == SLOT_WRITING;
+        ring->in_flight--;
+        if (cqe->res <= 0) {
+            if (status == BMPv3_OK) {
+                status = writing ? BMPv3_IO_ERROR : BMPv3_FILE_INVALID;
+            }
+            continue;
+        }
+        ring->done[slot] += cqe->res;
+        if (status != BMPv3_OK) {
+            continue;
+        }
+        if (ring->done[slot] < get_band_length(pipeline, ring->bands[slot])) {
+            queue_slot(ring, pipeline, slot);
+        } else if (!writing) {
+            ring->states[slot] = SLOT_READ;
+        } else {
+            long int band = ring->bands[slot] + BMPv3_PIPELINE_DEPTH;
+            ring->written_count++;
+            if (band < pipeline->bands_count) {
+                start_band(ring, pipeline, band, SLOT_READING);
+            }
+        }
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return status;
+}
+
+static BMPv3_STATUS run_uring_pipeline(URING* ring, PIPELINE* pipeline) {
+    long int next_process = 0;
+    BMPv3_STATUS status = BMPv3_OK;
+    for (long int band = 0; band < pipeline->bands_count && band < BMPv3_PIPELINE_DEPTH; band++) {
+        start_band(ring, pipeline, band, SLOT_READING);
+    }
+    while (ring->written_count < pipeline->bands_count && status == BMPv3_OK) {
+        int slot = (int)(next_process % BMPv3_PIPELINE_DEPTH);
+        if (next_process < pipeline->bands_count && ring->bands[slot] == next_process
+            && ring->states[slot] == SLOT_READ) {
+            process_band(pipeline, next_process);
+            start_band(ring, pipeline, next_process++, SLOT_WRITING);
+            status = enter_uring(ring, 0);
+        } else if ((status = enter_uring(ring, 1)) == BMPv3_OK) {
+            status = reap_completions(ring, pipeline, status);
+        }
+    }
+    /* The kernel may still be filling or draining slots after a failure; wait for it before they are freed.
+       Requests queued but never submitted are dropped, since the kernel has not seen them. */
+    ring->in_flight -= ring->to_submit;
+    ring->to_submit = 0;
+    while (ring->in_flight > 0) {
+        BMPv3_STATUS wait_status = enter_uring(ring, 1);
+        if (status == BMPv3_OK) {
+            status = wait_status;
+        }
+        status = reap_completions(ring, pipeline, status);
+    }
+    return status;
+}
+
+#endif
+
+BMPv3_STATUS pipeline_BMPv3_file(char* input_filename, char* output_filename, BMPv3_Stream_Handler* handler,
+                                 BMPv3_PIPELINE_BACKEND backend) {
+    BMPv3 bmp;
+    PIPELINE pipeline;
+    FILE* input;
+    FILE* output;
+    long int palette_size, row_size;
+    BMPv3_STATUS status = BMPv3_OK;
+    if (input_filename == NULL || output_filename == NULL || handler == NULL || handler->process_band == NULL) {
+        stream_BMPv3_file(input_filename, output_filename, handler);
+        return BMP_get_error();
+    }
+    memset(&bmp, 0, sizeof(BMPv3));
+    memset(&pipeline, 0, sizeof(PIPELINE));
+    input = open_BMPv3_file(&bmp, input_filename);
+    if (input == NULL) {
+        return BMP_get_error();
+    }
+    palette_size = get_BMPv3_data_offset(&bmp) - HEADER_BYTES_SIZE;
+    row_size = get_BMPv3_row_size(&bmp);
+    pipeline.input_fd = fileno(input);
+    pipeline.data_offset = get_BMPv3_data_offset(&bmp);
+    pipeline.data_size = bmp.header.image_data_size;
+    pipeline.band_size = row_size > 0 && row_size < BMPv3_STREAM_BAND_SIZE
+                         ? BMPv3_STREAM_BAND_SIZE / row_size * row_size : row_size;
+    pipeline.bands_count = pipeline.band_size > 0
+                           ? (pipeline.data_size + pipeline.band_size - 1) / pipeline.band_size : 0;
+    pipeline.handler = handler;
+    for (int i = 0; i < BMPv3_PIPELINE_DEPTH && status == BMPv3_OK; i++) {
+        pipeline.slots[i] = (unsigned char*)malloc(pipeline.band_size > 0 ? pipeline.band_size : 1);
+        if (pipeline.slots[i] == NULL) {
+            status = BMPv3_OUT_OF_MEMORY;
+        }
+    }
+    output = status == BMPv3_OK ? fopen(output_filename, "wb") : NULL;
+    if (status == BMPv3_OK && output == NULL) {
+        status = BMPv3_IO_ERROR;
+    }
+    if (status == BMPv3_OK) {
+        if (handler->prepare != NULL) {
+            handler->prepare(&bmp, handler->context);
+        }
+        if (write_header(&bmp, output) != BMPv3_OK
+            || (palette_size > 0 && fwrite(bmp.palette, sizeof(unsigned char), palette_size, output) != palette_size)
+            || fflush(output) != 0) {
+            status = BMPv3_IO_ERROR;
+        }
+    }
+    if (status == BMPv3_OK) {
+        pipeline.output_fd = fileno(output);
+#ifdef BMP_HAVE_IO_URING
+        URING ring;
+        if (backend == BMPv3_PIPELINE_AUTO && open_uring(&ring) == 0) {
+            status = run_uring_pipeline(&ring, &pipeline);
+            close_uring(&ring);
+        } else {
+            status = run_thread_pipeline(&pipeline);
+        }
+#else
+        status = run_thread_pipeline(&pipeline);
+#endif
+    }
+    for (int i = 0; i < BMPv3_PIPELINE_DEPTH; i++) {
+        free(pipeline.slots[i]);
+    }
+    free(bmp.palette);
+    fclose(input);
+    if (output != NULL && fclose(output) != 0 && status == BMPv3_OK) {
+        status = BMPv3_IO_ERROR;
+    }
+    return status;
+}
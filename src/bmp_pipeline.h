@@ -0,0 +1,22 @@
+#include "bmp_handler.h"
+
+#ifndef HOMEWORK_4_BMP_PIPELINE_H
+#define HOMEWORK_4_BMP_PIPELINE_H
+
+/* Bands of BMPv3_STREAM_BAND_SIZE bytes buffered at once. */
+#define BMPv3_PIPELINE_DEPTH 4
+
+typedef enum {
+    BMPv3_PIPELINE_AUTO,
+    BMPv3_PIPELINE_THREADS
+} BMPv3_PIPELINE_BACKEND;
+
+/* Same contract as stream_BMPv3_file, but several bands are in flight at once: while the handler
+   processes band N on the calling thread, band N + 1 is being read and band N - 1 written.
+   BMPv3_PIPELINE_AUTO queues the reads and writes on io_uring when the build and the kernel
+   support it; otherwise, and with BMPv3_PIPELINE_THREADS, a reader and a writer thread do them.
+   Returns the status instead of leaving it for BMP_get_error, since it is set on several threads. */
+BMPv3_STATUS pipeline_BMPv3_file(char* input_filename, char* output_filename, BMPv3_Stream_Handler* handler,
+                                 BMPv3_PIPELINE_BACKEND backend);
+
+#endif //HOMEWORK_4_BMP_PIPELINE_H
@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bmp_hash.h"
+#include "bmp_index.h"
+
+#define error(...) (fprintf(stderr, __VA_ARGS__))
+
+typedef struct {
+    int threads_count;
+    char* index_filename;
+    char* load_filename;
+    int hashed;
+    int first_path;
+} BMPINFO_OPTIONS;
+
+int scan_threads_count(char* argument, int* threads_count) {
+    char* end;
+    long int value = strtol(argument, &end, 10);
+    if (*argument == '\0' || *end != '\0' || value < 1 || value > MAX_THREADS_COUNT) {
+        error("Count of threads must be a number from 1 to %d", MAX_THREADS_COUNT);
+        return 1;
+    }
+    *threads_count = (int)value;
+    return 0;
+}
+
+int scan_arguments(int count_of_arguments, char** arguments, BMPINFO_OPTIONS* options) {
+    int i = 1;
+    memset(options, 0, sizeof(BMPINFO_OPTIONS));
+    options->threads_count = 1;
+    for (; i < count_of_arguments && strncmp(arguments[i], "--", 2) == 0; i++) {
+        if (strcmp(arguments[i], "--threads") == 0 && i + 1 < count_of_arguments) {
+            if (scan_threads_count(arguments[++i], &options->threads_count)) {
+                return 1;
+            }
+        } else if (strcmp(arguments[i], "--index") == 0 && i + 1 < count_of_arguments) {
+            options->index_filename = arguments[++i];
+        } else if (strcmp(arguments[i], "--load") == 0 && i + 1 < count_of_arguments) {
+            options->load_filename = arguments[++i];
+        } else if (strcmp(arguments[i], "--hash") == 0) {
+            options->hashed = 1;
+        } else {
+            error("Unknown option %s", arguments[i]);
+            return 1;
+        }
+    }
+    options->first_path = i;
+    if (options->load_filename != NULL) {
+        if (i != count_of_arguments || options->index_filename != NULL || options->hashed) {
+            error("%s", "Option --load takes no paths and cannot be combined with --index and --hash");
+            return 1;
+        }
+    } else if (i == count_of_arguments) {
+        error("%s", "Usage: bmpinfo [--threads N] [--index out.idx | --hash] <file or directory>...\n"
+                    "       bmpinfo --load in.idx");
+        return 1;
+    }
+    return 0;
+}
+
+void print_index(BMP_Index* index) {
+    BMP_INDEX_ENTRY entry;
+    long int count = bmp_index_size(index);
+    for (long int i = 0; i < count; i++) {
+        bmp_index_get(index, i, &entry);
+        if (entry.status == BMPv3_OK || entry.status == BMPv3_FILE_NOT_SUPPORTED) {
+            printf("%s\t%ld\t%ld\t%d\t%ld%s\n", entry.filename, entry.width, entry.height,
+                   entry.bits_per_pixel, entry.data_offset,
+                   entry.status == BMPv3_OK ? "" : "\tnot supported");
+        } else {
+            printf("%s\t%s\n", entry.filename, BMP_get_status_description(entry.status));
+        }
+    }
+}
+
+/* Prints the content hash of every readable image, taken from its sidecar when that is fresh;
+   otherwise the image is read, hashed over the pool and a new sidecar is saved, so that later
+   passes and comparer --hash need not read its pixels. Images with equal hashes are duplicates. */
+int print_hashes(BMP_Index* index, Thread_Pool* pool) {
+    BMP_INDEX_ENTRY entry;
+    BMP_HASHES hashes;
+    long int count = bmp_index_size(index);
+    int result = 0;
+    for (long int i = 0; i < count; i++) {
+        bmp_index_get(index, i, &entry);
+        if (entry.status == BMPv3_OK && bmp_hash_load(entry.filename, &hashes) != 0) {
+            BMPv3* image = read_BMPv3_file(entry.filename);
+            entry.status = BMP_get_error();
+            if (image != NULL && bmp_hash_image(image, pool, &hashes)) {
+                entry.status = BMPv3_OUT_OF_MEMORY;
+            } else if (image != NULL) {
+                bmp_hash_save(entry.filename, &hashes);
+            }
+            BMPv3_free(image);
+        }
+        if (entry.status == BMPv3_OK) {
+            printf("%016llx\t%s\n", hashes.image_hash, entry.filename);
+            bmp_hash_free(&hashes);
+        } else {
+            printf("%s\t%s\n", entry.filename, BMP_get_status_description(entry.status));
+            result = -2;
+        }
+    }
+    return result;
+}
+
+int main(int argc, char* argv[]) {
+    BMPINFO_OPTIONS options;
+    BMP_Index* index;
+    if (scan_arguments(argc, argv, &options)) {
+        return -1;
+    }
+    if (options.load_filename != NULL) {
+        index = bmp_index_load(options.load_filename);
+        if (index == NULL) {
+            return -2;
+        }
+        print_index(index);
+        bmp_index_free(index);
+        return 0;
+    }
+    index = bmp_index_create();
+    if (index == NULL) {
+        error("%s", "Could not allocate memory for the index");
+        return -1;
+    }
+    for (int i = options.first_path; i < argc; i++) {
+        if (bmp_index_add_path(index, argv[i])) {
+            bmp_index_free(index);
+            return -2;
+        }
+    }
+    Thread_Pool* pool = thread_pool_create(options.threads_count);
+    if (pool == NULL) {
+        error("%s", "Could not start the worker threads");
+        bmp_index_free(index);
+        return -1;
+    }
+    bmp_index_probe(index, pool);
+    int result = 0;
+    if (options.hashed) {
+        result = print_hashes(index, pool);
+    } else if (options.index_filename != NULL) {
+        result = bmp_index_save(index, options.index_filename) ? -1 : 0;
+    } else {
+        print_index(index);
+    }
+    thread_pool_destroy(pool);
+    bmp_index_free(index);
+    return result;
+}
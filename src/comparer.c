@@ -1,81 +1,191 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include "bmp_handler.h"
-#include <math.h>
+#include "comparison.h"
+#include "stats.h"
 
 #define NORMAL_ARGUMENTS_COUNT 2
 #define error(...) (fprintf(stderr, __VA_ARGS__))
-#define BYTES_COUNT_IN_PIXEL 3
 #define MAX_FILENAME_SIZE 255
-#define MAX_DIFF_PIXELS_COUNT 100
-#define BMP_PALETTE_SIZE_8bpp (256 * 4)
 
-int compare_images(BMPv3* image1, BMPv3* image2) {
-    if (image1->header.bits_per_pixel != image2->header.bits_per_pixel) {
-        error("%s", "Images must be of the same bitness");
-        return -1;
+typedef struct {
+    int threads_count;
+    int streamed;
+    int huge_pages;
+    int aligned_rows;
+    int hashed;
+    char* report_filename;
+    MISMATCH_REPORT_FORMAT report_format;
+    int stats;
+    STATS_FORMAT stats_format;
+    COMPARISON_SETTINGS settings;
+    char input_filename1[MAX_FILENAME_SIZE];
+    char input_filename2[MAX_FILENAME_SIZE];
+} COMPARER_OPTIONS;
+
+int scan_threads_count(char* argument, int* threads_count) {
+    char* end;
+    long int value = strtol(argument, &end, 10);
+    if (*argument == '\0' || *end != '\0' || value < 1 || value > MAX_THREADS_COUNT) {
+        error("Count of threads must be a number from 1 to %d", MAX_THREADS_COUNT);
+        return 0;
     }
-    if (image1->header.width != image2->header.width || abs(image1->header.height) != abs(image2->header.height)) {
-        error("%s", "Images must be equal size");
-        return -1;
+    *threads_count = (int)value;
+    return 1;
+}
+
+int scan_tolerance(char* argument, int* tolerance) {
+    char* end;
+    long int value = strtol(argument, &end, 10);
+    if (*argument == '\0' || *end != '\0' || value < 0 || value > 255) {
+        error("%s", "Tolerance must be a number from 0 to 255");
+        return 0;
+    }
+    *tolerance = (int)value;
+    return 1;
+}
+
+int scan_mismatches_limit(char* argument, long int* limit) {
+    char* end;
+    if (strcmp(argument, "all") == 0) {
+        *limit = -1;
+        return 1;
+    }
+    long int value = strtol(argument, &end, 10);
+    if (*argument == '\0' || *end != '\0' || value < 1) {
+        error("%s", "Limit of mismatches must be a positive number or all");
+        return 0;
     }
-    int width = image1->header.width;
-    int height = abs(image1->header.height);
-    int bits_per_pixel = image1->header.bits_per_pixel;
-    int count_diff = 0;
-    int heights_prod = image1->header.height * image2->header.height;
-    int index_1, index_2 = 0;
-    if (bits_per_pixel == 8) {
-        for (int i = 0; i < BMP_PALETTE_SIZE_8bpp; i++) {
-            if (image1->palette[i] != image2->palette[i]) {
-                error("%s", "Images have different palettes");
+    *limit = value;
+    return 1;
+}
+
+int scan_arguments(int count_of_arguments, char** arguments, COMPARER_OPTIONS* options) {
+    int i = 1;
+    memset(options, 0, sizeof(COMPARER_OPTIONS));
+    options->threads_count = 1;
+    for (; i < count_of_arguments && strncmp(arguments[i], "--", 2) == 0; i++) {
+        if (strcmp(arguments[i], "--threads") == 0 && i + 1 < count_of_arguments) {
+            if (!scan_threads_count(arguments[++i], &options->threads_count)) {
                 return 0;
             }
-        }
-    }
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            for (int i = 0; i < bits_per_pixel / 8; i++) {
-                index_2 = (bits_per_pixel / 8) * (y * width + x) + i;
-                if (heights_prod > 0) index_1 = index_2;
-                else index_1 = (bits_per_pixel / 8) * ((height - y - 1) * width + x) + i;
-                if (image1->data[index_1] != image2->data[index_2]) {
-                    error("%d %d\n", x, y);
-                    count_diff++;
-                    if (count_diff == MAX_DIFF_PIXELS_COUNT) {
-                        return 0;
-                    }
-                    break;
-                }
+        } else if (strcmp(arguments[i], "--stream") == 0) {
+            options->streamed = 1;
+        } else if (strcmp(arguments[i], "--huge-pages") == 0) {
+            options->huge_pages = 1;
+        } else if (strcmp(arguments[i], "--aligned") == 0) {
+            options->aligned_rows = 1;
+        } else if (strcmp(arguments[i], "--tolerance") == 0 && i + 1 < count_of_arguments) {
+            if (!scan_tolerance(arguments[++i], &options->settings.tolerance)) {
+                return 0;
+            }
+        } else if (strcmp(arguments[i], "--metrics") == 0) {
+            options->settings.measure = 1;
+        } else if (strcmp(arguments[i], "--hash") == 0) {
+            options->hashed = 1;
+        } else if (strcmp(arguments[i], "--diff-mask") == 0 && i + 1 < count_of_arguments) {
+            options->settings.mask_filename = arguments[++i];
+        } else if (strcmp(arguments[i], "--boxes") == 0) {
+            options->settings.find_boxes = 1;
+        } else if (strcmp(arguments[i], "--limit") == 0 && i + 1 < count_of_arguments) {
+            if (!scan_mismatches_limit(arguments[++i], &options->settings.mismatches_limit)) {
+                return 0;
             }
+        } else if (strcmp(arguments[i], "--report") == 0 && i + 1 < count_of_arguments) {
+            options->report_filename = arguments[++i];
+        } else if (strcmp(arguments[i], "--binary") == 0) {
+            options->report_format = MISMATCH_REPORT_BINARY;
+        } else if (strcmp(arguments[i], "--stats") == 0 || strcmp(arguments[i], "--stats=json") == 0) {
+            options->stats = 1;
+            options->stats_format = arguments[i][7] == '=' ? STATS_JSON : STATS_TEXT;
+        } else {
+            error("Unknown option %s", arguments[i]);
+            return 0;
         }
     }
-    return 0;
-}
-
-int scan_arguments(int count_of_arguments, char** arguments,
-                   char* input_filename1, char* input_filename2) {
-    if (count_of_arguments - 1 != NORMAL_ARGUMENTS_COUNT) {
+    if (options->streamed && options->threads_count > 1) {
+        error("%s", "Option --stream cannot be combined with --threads");
+        return 0;
+    }
+    if (count_of_arguments - i != NORMAL_ARGUMENTS_COUNT) {
         error("%s", "Count of arguments must be 2");
         return 0;
     }
-    strcpy(input_filename1, arguments[1]);
-    strcpy(input_filename2, arguments[2]);
+    strcpy(options->input_filename1, arguments[i]);
+    strcpy(options->input_filename2, arguments[i + 1]);
     return 1;
 }
 
-int main(int argc, char* argv[]) {
-    char input_filename1[MAX_FILENAME_SIZE];
-    char input_filename2[MAX_FILENAME_SIZE];
-    if (!scan_arguments(argc, argv, input_filename1, input_filename2)) {
-        return -1;
+/* With --stream and --hash the files are read while they are compared, so the compare phase
+   of --stats includes those reads. */
+int compare_files(COMPARER_OPTIONS* options, Thread_Pool* pool) {
+    STATS_SCOPE(STATS_COMPARE);
+    if (options->hashed) {
+        return compare_files_hashed(options->input_filename1, options->input_filename2, pool,
+                                    &options->settings, options->streamed);
+    }
+    return compare_files_streamed(options->input_filename1, options->input_filename2, &options->settings);
+}
+
+int compare_read_images(BMPv3* image1, BMPv3* image2, Thread_Pool* pool, COMPARISON_SETTINGS* settings) {
+    STATS_SCOPE(STATS_COMPARE);
+    return compare_images(image1, image2, pool, settings);
+}
+
+int compare(COMPARER_OPTIONS* options) {
+    if (options->streamed && !options->hashed) {
+        return compare_files(options, NULL);
+    }
+    BMPv3_use_huge_pages(options->huge_pages);
+    BMPv3_use_aligned_rows(options->aligned_rows);
+    if (options->hashed) {
+        Thread_Pool* pool = thread_pool_create(options->threads_count);
+        if (pool == NULL) {
+            error("%s", "Could not start the worker threads");
+            return -1;
+        }
+        int result = compare_files(options, pool);
+        thread_pool_destroy(pool);
+        return result;
     }
-    BMPv3* image1 = read_BMPv3_file(input_filename1);
+    BMPv3* image1 = read_BMPv3_file(options->input_filename1);
     BMP_ERROR_CHECK(stderr, -2);
-    BMPv3* image2 = read_BMPv3_file(input_filename2);
+    BMPv3* image2 = read_BMPv3_file(options->input_filename2);
     BMP_ERROR_CHECK(stderr, -2);
-    if (compare_images(image1, image2)) {
+    Thread_Pool* pool = thread_pool_create(options->threads_count);
+    if (pool == NULL) {
+        error("%s", "Could not start the worker threads");
+        return -1;
+    }
+    int result = compare_read_images(image1, image2, pool, &options->settings);
+    thread_pool_destroy(pool);
+    BMPv3_free(image1);
+    BMPv3_free(image2);
+    if (result) {
         return -1;
     }
     return 0;
 }
+
+int main(int argc, char* argv[]) {
+    COMPARER_OPTIONS options;
+    if (!scan_arguments(argc, argv, &options)) {
+        return -1;
+    }
+    if (options.stats && !stats_enable(options.stats_format)) {
+        error("%s", "Option --stats needs a build configured with -DBMP_STATS=ON");
+        return -1;
+    }
+    if (options.report_filename != NULL || options.report_format != MISMATCH_REPORT_TEXT) {
+        options.settings.report = mismatch_report_open(options.report_filename, options.report_format);
+        if (options.settings.report == NULL) {
+            return -1;
+        }
+    }
+    int result = compare(&options);
+    if (options.settings.report != NULL && mismatch_report_close(options.settings.report) != 0) {
+        result = -1;
+    }
+    stats_print();
+    return result;
+}
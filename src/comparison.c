@@ -0,0 +1,629 @@
+#include "comparison.h"
+#include "bmp_hash.h"
+#include "diff_regions.h"
+#include "difference.h"
+#include "stats.h"
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define error(...) (fprintf(stderr, __VA_ARGS__))
+#define TILE_SIZE (256 * 1024)
+
+/* Sums of one part of the comparison, added up once every part is done. */
+typedef struct {
+    unsigned long long squared_sum;
+    int max_difference;
+} DIFFERENCES;
+
+typedef struct {
+    int done;
+    long int count;
+    long int capacity;
+    int* coordinates;
+    DIFFERENCES differences;
+    DIFF_RUNS runs;
+} TILE_MISMATCHES;
+
+/* How a pair of stored rows is turned into colours and compared. */
+typedef struct {
+    int width;
+    int bits_per_pixel;
+    /* Bytes compared per pixel: 3 for indexed images, whose rows are resolved to BGR. */
+    int channels_count;
+    /* Bytes of the stored row that hold pixels, without the padding. */
+    long int row_size;
+    const unsigned char* palette_1;
+    const unsigned char* palette_2;
+    int same_palettes;
+    int tolerance;
+    int measure;
+    /* Mismatched pixels are marked in the mask rows and collected in runs for the boxes. */
+    BMPv3* mask;
+    int find_boxes;
+    /* Every row has to be compared, not only the ones holding the first mismatches. */
+    int whole_image;
+    /* How many mismatches are reported. */
+    long int limit;
+    /* Rows are looked up in equal_tiles by their number from the bottom of the image. */
+    const unsigned char* equal_tiles;
+    long int equal_tile_rows;
+    long int height;
+    int top_down_2;
+} ROW_COMPARISON;
+
+/* Tiles of rows are compared in parallel. Every tile keeps its own first mismatches, and
+   tiles finished in row order are folded into confirmed_count; once that reaches
+   the limit, the tiles after the last folded one are not needed any more,
+   unless the whole image is needed for the metrics, the mask or the boxes. */
+typedef struct {
+    BMPv3* image1;
+    BMPv3* image2;
+    ROW_COMPARISON rows;
+    int height;
+    int same_orientation;
+    long int rows_per_tile;
+    long int tiles_count;
+    TILE_MISMATCHES* tiles;
+    pthread_mutex_t lock;
+    long int first_unfinished_tile;
+    long int last_needed_tile;
+    long int confirmed_count;
+    /* Set by any worker that runs out of memory, and polled by all of them. */
+    int out_of_memory;
+} COMPARISON;
+
+/* Rows are compared without their padding: (bits per pixel * width) bits rounded up to bytes.
+   They are still found at their stored stride, which includes the padding. */
+static long int get_packed_row_size(int bits_per_pixel, int width) {
+    return ((long int)bits_per_pixel * width + 7) / 8;
+}
+
+static int is_indexed(int bits_per_pixel) {
+    return bits_per_pixel <= 8;
+}
+
+static void set_row_comparison(ROW_COMPARISON* rows, BMPv3* image1, BMPv3* image2,
+                               const COMPARISON_SETTINGS* settings) {
+    long int palette_size = get_BMPv3_palette_size(image1);
+    rows->width = image1->header.width;
+    rows->bits_per_pixel = image1->header.bits_per_pixel;
+    rows->channels_count = is_indexed(rows->bits_per_pixel) ? 3 : rows->bits_per_pixel / 8;
+    rows->row_size = get_packed_row_size(rows->bits_per_pixel, rows->width);
+    rows->palette_1 = image1->palette;
+    rows->palette_2 = image2->palette;
+    rows->same_palettes = palette_size == 0 || memcmp(image1->palette, image2->palette, palette_size) == 0;
+    rows->tolerance = settings != NULL ? settings->tolerance : 0;
+    rows->measure = settings != NULL && settings->measure;
+    rows->mask = NULL;
+    rows->find_boxes = settings != NULL && settings->find_boxes;
+    rows->whole_image = rows->measure || rows->find_boxes || (settings != NULL && settings->mask_filename != NULL);
+    rows->limit = MAX_DIFF_PIXELS_COUNT;
+    if (settings != NULL && settings->mismatches_limit != 0) {
+        rows->limit = settings->mismatches_limit < 0 ? LONG_MAX : settings->mismatches_limit;
+    }
+    rows->equal_tiles = settings != NULL && settings->equal_tile_rows > 0 ? settings->equal_tiles : NULL;
+    rows->equal_tile_rows = settings != NULL ? settings->equal_tile_rows : 0;
+    rows->height = labs(image2->header.height);
+    rows->top_down_2 = image2->header.height < 0;
+}
+
+/* y is counted in the row order of the second image. */
+static int is_row_known_equal(const ROW_COMPARISON* rows, long int y) {
+    if (rows->equal_tiles == NULL) {
+        return 0;
+    }
+    return rows->equal_tiles[(rows->top_down_2 ? rows->height - y - 1 : y) / rows->equal_tile_rows];
+}
+
+/* Bytes needed to resolve both rows of an indexed image; none for the others. */
+static size_t get_scratch_size(const ROW_COMPARISON* rows) {
+    return is_indexed(rows->bits_per_pixel) ? 2 * (size_t)rows->width * 3 : 0;
+}
+
+/* 4 bpp pixels are nibbles, the leftmost pixel in the high one. */
+static void resolve_row(const ROW_COMPARISON* rows, const unsigned char* row, const unsigned char* palette,
+                        unsigned char* colours) {
+    for (int x = 0; x < rows->width; x++) {
+        int index = rows->bits_per_pixel == 8 ? row[x] : (row[x / 2] >> (x % 2 ? 0 : 4)) & 0x0F;
+        memcpy(colours + 3 * x, palette + 4 * index, 3);
+    }
+}
+
+static int is_pixel_different(const unsigned char* colours_1, const unsigned char* colours_2, int x,
+                              int channels_count, int tolerance) {
+    for (int c = x * channels_count; c < (x + 1) * channels_count; c++) {
+        int difference = colours_1[c] > colours_2[c] ? colours_1[c] - colours_2[c] : colours_2[c] - colours_1[c];
+        if (difference > tolerance) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void mark_run(const ROW_COMPARISON* rows, long int y, int x_begin, int x_end, DIFF_RUNS* runs) {
+    if (rows->mask != NULL) {
+        memset(get_BMPv3_row(rows->mask, y) + x_begin, 0xFF, x_end - x_begin);
+    }
+    if (rows->find_boxes) {
+        add_diff_run(runs, x_begin, x_end, y);
+    }
+}
+
+/* Compares a pair of stored rows, adding their metrics to differences when they are measured,
+   and writes the x of up to limit mismatched pixels to mismatches. Returns how many it wrote.
+   With a mask or boxes, every mismatched pixel of row y (of the second image) is also marked
+   in runs, found in the same scan.
+   Rows with equal bytes and palettes are skipped with memcmp; otherwise a tolerance or metrics
+   run one pass of measure_differences and look at single pixels only in rows whose largest
+   difference is too big. */
+static int compare_rows(const ROW_COMPARISON* rows, long int y, const unsigned char* row_1,
+                        const unsigned char* row_2, unsigned char* scratch, int* mismatches, int limit,
+                        DIFFERENCES* differences, DIFF_RUNS* runs) {
+    const unsigned char* colours_1 = row_1;
+    const unsigned char* colours_2 = row_2;
+    long int size = rows->row_size;
+    int marked = rows->mask != NULL || rows->find_boxes;
+    int run_begin = -1;
+    int count = 0;
+    STATS_COUNT(STATS_COMPARE, 2 * rows->row_size);
+    if (rows->same_palettes && memcmp(row_1, row_2, rows->row_size) == 0) {
+        return 0;
+    }
+    if (is_indexed(rows->bits_per_pixel)) {
+        size = (long int)rows->width * 3;
+        resolve_row(rows, row_1, rows->palette_1, scratch);
+        resolve_row(rows, row_2, rows->palette_2, scratch + size);
+        colours_1 = scratch;
+        colours_2 = scratch + size;
+    }
+    if (rows->measure || rows->tolerance > 0) {
+        int max_difference = measure_differences(colours_1, colours_2, size, &differences->squared_sum);
+        if (max_difference > differences->max_difference) {
+            differences->max_difference = max_difference;
+        }
+        if (max_difference <= rows->tolerance) {
+            return 0;
+        }
+    } else if (is_indexed(rows->bits_per_pixel) && memcmp(colours_1, colours_2, size) == 0) {
+        return 0;
+    }
+    for (int x = 0; x < rows->width && (count < limit || marked); x++) {
+        if (!is_pixel_different(colours_1, colours_2, x, rows->channels_count, rows->tolerance)) {
+            if (run_begin >= 0) {
+                mark_run(rows, y, run_begin, x, runs);
+                run_begin = -1;
+            }
+            continue;
+        }
+        if (count < limit) {
+            mismatches[count++] = x;
+        }
+        if (marked && run_begin < 0) {
+            run_begin = x;
+        }
+    }
+    if (run_begin >= 0) {
+        mark_run(rows, y, run_begin, rows->width, runs);
+    }
+    return count;
+}
+
+/* Prints the boxes of the runs, which must be in row order. Returns -1 if memory runs out. */
+static int print_boxes(const DIFF_RUNS* runs) {
+    DIFF_BOX* boxes;
+    long int boxes_count = runs->out_of_memory ? -1 : find_diff_boxes(runs, &boxes);
+    if (boxes_count < 0) {
+        error("%s", "Could not allocate enough memory to find the mismatched regions");
+        return -1;
+    }
+    for (long int i = 0; i < boxes_count; i++) {
+        printf("BOX %d %ld %d %ld %ld\n", boxes[i].x_first, boxes[i].y_first, boxes[i].x_last, boxes[i].y_last,
+               boxes[i].pixels_count);
+    }
+    free(boxes);
+    return 0;
+}
+
+/* Returns -1 (with the problem printed) if the mask file cannot be created. */
+static int create_mask(ROW_COMPARISON* rows, const COMPARISON_SETTINGS* settings, BMPv3* image2) {
+    if (settings == NULL || settings->mask_filename == NULL) {
+        return 0;
+    }
+    rows->mask = create_diff_mask(settings->mask_filename, image2->header.width, image2->header.height);
+    if (rows->mask == NULL) {
+        error("%s: %s\n", settings->mask_filename, BMP_get_error_description());
+        return -1;
+    }
+    return 0;
+}
+
+static void add_differences(DIFFERENCES* total, const DIFFERENCES* part) {
+    total->squared_sum += part->squared_sum;
+    if (part->max_difference > total->max_difference) {
+        total->max_difference = part->max_difference;
+    }
+}
+
+/* MSE is taken over every compared byte: the channels of the pixels or of their palette colours. */
+static double get_samples_count(const ROW_COMPARISON* rows) {
+    return (double)rows->width * rows->height * rows->channels_count;
+}
+
+static void print_differences(double samples_count, const DIFFERENCES* differences) {
+    double mse = samples_count > 0 ? differences->squared_sum / samples_count : 0;
+    if (mse == 0) {
+        printf("MSE 0 PSNR inf MAX %d\n", differences->max_difference);
+    } else {
+        printf("MSE %.6f PSNR %.4f MAX %d\n", mse, 10 * log10(255.0 * 255.0 / mse), differences->max_difference);
+    }
+}
+
+static int is_tile_needed(COMPARISON* comparison, long int tile) {
+    return tile <= __atomic_load_n(&comparison->last_needed_tile, __ATOMIC_RELAXED);
+}
+
+static void finish_tile(COMPARISON* comparison, long int tile) {
+    pthread_mutex_lock(&comparison->lock);
+    comparison->tiles[tile].done = 1;
+    while (comparison->confirmed_count < comparison->rows.limit
+           && comparison->first_unfinished_tile < comparison->tiles_count
+           && comparison->tiles[comparison->first_unfinished_tile].done) {
+        comparison->confirmed_count += comparison->tiles[comparison->first_unfinished_tile].count;
+        comparison->first_unfinished_tile++;
+        if (comparison->confirmed_count >= comparison->rows.limit) {
+            __atomic_store_n(&comparison->last_needed_tile, comparison->first_unfinished_tile - 1, __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&comparison->lock);
+}
+
+/* How many mismatches compare_rows may still take from one row once count of them are taken. */
+static int get_row_limit(const ROW_COMPARISON* rows, long int count) {
+    long int left = rows->limit - count;
+    return left < rows->width ? (int)left : rows->width;
+}
+
+/* Makes room for count more coordinates; returns 0 when out of memory. */
+static int reserve_mismatches(TILE_MISMATCHES* mismatches, long int count) {
+    if (mismatches->count + count <= mismatches->capacity) {
+        return 1;
+    }
+    long int capacity = mismatches->capacity > 0 ? mismatches->capacity * 2 : MAX_DIFF_PIXELS_COUNT;
+    while (capacity < mismatches->count + count) {
+        capacity *= 2;
+    }
+    int* coordinates = (int*)realloc(mismatches->coordinates, 2 * capacity * sizeof(int));
+    if (coordinates == NULL) {
+        return 0;
+    }
+    mismatches->coordinates = coordinates;
+    mismatches->capacity = capacity;
+    return 1;
+}
+
+static void compare_tile(long int begin, long int end, void* context) {
+    COMPARISON* comparison = (COMPARISON*)context;
+    long int tile = begin / comparison->rows_per_tile;
+    TILE_MISMATCHES* mismatches = &comparison->tiles[tile];
+    unsigned char* scratch = NULL;
+    size_t scratch_size = get_scratch_size(&comparison->rows);
+    int* row_mismatches = (int*)malloc(comparison->rows.width * sizeof(int));
+    if (row_mismatches == NULL || (scratch_size > 0 && (scratch = (unsigned char*)malloc(scratch_size)) == NULL)) {
+        __atomic_store_n(&comparison->out_of_memory, 1, __ATOMIC_RELAXED);
+    }
+    for (long int y = begin; y < end && !__atomic_load_n(&comparison->out_of_memory, __ATOMIC_RELAXED)
+                             && (comparison->rows.whole_image || is_tile_needed(comparison, tile)); y++) {
+        if (is_row_known_equal(&comparison->rows, y)) {
+            continue;
+        }
+        long int y1 = comparison->same_orientation ? y : comparison->height - y - 1;
+        int count = compare_rows(&comparison->rows, y, get_BMPv3_row(comparison->image1, y1),
+                                 get_BMPv3_row(comparison->image2, y), scratch, row_mismatches,
+                                 get_row_limit(&comparison->rows, mismatches->count), &mismatches->differences,
+                                 &mismatches->runs);
+        if (count > 0 && !reserve_mismatches(mismatches, count)) {
+            __atomic_store_n(&comparison->out_of_memory, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        for (int i = 0; i < count; i++) {
+            mismatches->coordinates[2 * mismatches->count] = row_mismatches[i];
+            mismatches->coordinates[2 * mismatches->count + 1] = (int)y;
+            mismatches->count++;
+        }
+        if (mismatches->count == comparison->rows.limit && !comparison->rows.whole_image) {
+            break;
+        }
+    }
+    free(row_mismatches);
+    free(scratch);
+    finish_tile(comparison, tile);
+}
+
+/* The report named by the settings, or a new text report to stderr when they name none. */
+static Mismatch_Report* open_report(const COMPARISON_SETTINGS* settings) {
+    if (settings != NULL && settings->report != NULL) {
+        return settings->report;
+    }
+    return mismatch_report_open(NULL, MISMATCH_REPORT_TEXT);
+}
+
+/* Closes the report unless it belongs to the caller; returns -1 if it could not be written. */
+static int close_report(Mismatch_Report* report, const COMPARISON_SETTINGS* settings) {
+    if (settings != NULL && settings->report != NULL) {
+        return 0;
+    }
+    return mismatch_report_close(report) != 0 ? -1 : 0;
+}
+
+/* Returns -1 if the images cannot be compared and 0 otherwise. */
+static int check_images(BMPv3* image1, BMPv3* image2) {
+    if (image1->header.bits_per_pixel != image2->header.bits_per_pixel) {
+        error("%s", "Images must be of the same bitness");
+        return -1;
+    }
+    if (image1->header.width != image2->header.width || labs(image1->header.height) != labs(image2->header.height)) {
+        error("%s", "Images must be equal size");
+        return -1;
+    }
+    if (image1->header.image_data_size < get_BMPv3_row_size(image1) * labs(image1->header.height)
+        || image2->header.image_data_size < get_BMPv3_row_size(image2) * labs(image2->header.height)) {
+        error("%s", BMP_get_status_description(BMPv3_FILE_INVALID));
+        return -1;
+    }
+    return 0;
+}
+
+int compare_images(BMPv3* image1, BMPv3* image2, Thread_Pool* pool, const COMPARISON_SETTINGS* settings) {
+    if (check_images(image1, image2) != 0) {
+        return -1;
+    }
+    COMPARISON comparison;
+    memset(&comparison, 0, sizeof(COMPARISON));
+    comparison.image1 = image1;
+    comparison.image2 = image2;
+    set_row_comparison(&comparison.rows, image1, image2, settings);
+    if (create_mask(&comparison.rows, settings, image2) != 0) {
+        return -1;
+    }
+    comparison.height = labs(image1->header.height);
+    comparison.same_orientation = (image1->header.height < 0) == (image2->header.height < 0);
+    comparison.rows_per_tile = comparison.rows.row_size < TILE_SIZE ? TILE_SIZE / comparison.rows.row_size : 1;
+    comparison.tiles_count = (comparison.height + comparison.rows_per_tile - 1) / comparison.rows_per_tile;
+    comparison.last_needed_tile = comparison.tiles_count - 1;
+    comparison.tiles = (TILE_MISMATCHES*)calloc(comparison.tiles_count > 0 ? comparison.tiles_count : 1,
+                                                sizeof(TILE_MISMATCHES));
+    if (comparison.tiles == NULL) {
+        error("%s", "Could not allocate enough memory to compare the images");
+        BMPv3_free(comparison.rows.mask);
+        return -1;
+    }
+    pthread_mutex_init(&comparison.lock, NULL);
+    thread_pool_run(pool, comparison.height, comparison.rows_per_tile, compare_tile, &comparison);
+    pthread_mutex_destroy(&comparison.lock);
+    Mismatch_Report* report = NULL;
+    int result = 0;
+    if (comparison.out_of_memory) {
+        error("%s", "Could not allocate enough memory to compare the images");
+        result = -1;
+    } else if ((report = open_report(settings)) == NULL) {
+        result = -1;
+    } else {
+        long int count_diff = 0;
+        DIFFERENCES differences = {0, 0};
+        DIFF_RUNS runs;
+        memset(&runs, 0, sizeof(DIFF_RUNS));
+        for (long int tile = 0; tile < comparison.tiles_count; tile++) {
+            TILE_MISMATCHES* mismatches = &comparison.tiles[tile];
+            for (long int i = 0; i < mismatches->count && count_diff < comparison.rows.limit; i++, count_diff++) {
+                mismatch_report_add(report, mismatches->coordinates[2 * i], mismatches->coordinates[2 * i + 1]);
+            }
+            add_differences(&differences, &mismatches->differences);
+            append_diff_runs(&runs, &mismatches->runs);
+        }
+        result = close_report(report, settings);
+        if (comparison.rows.measure) {
+            print_differences(get_samples_count(&comparison.rows), &differences);
+        }
+        if (result == 0 && comparison.rows.find_boxes) {
+            result = print_boxes(&runs);
+        }
+        free_diff_runs(&runs);
+    }
+    for (long int tile = 0; tile < comparison.tiles_count; tile++) {
+        free(comparison.tiles[tile].coordinates);
+        free_diff_runs(&comparison.tiles[tile].runs);
+    }
+    free(comparison.tiles);
+    BMPv3_free(comparison.rows.mask);
+    return result;
+}
+
+static int read_rows(FILE* f, long int offset, unsigned char* rows, long int size) {
+    while (size > 0) {
+        ssize_t count = pread(fileno(f), rows, size, offset);
+        if (count <= 0) {
+            return 0;
+        }
+        rows += count;
+        offset += count;
+        size -= count;
+    }
+    return 1;
+}
+
+/* When only one of the files is stored top-down, its bands are read from the end of the file. */
+int compare_files_streamed(char* filename1, char* filename2, const COMPARISON_SETTINGS* settings) {
+    BMPv3 image1, image2;
+    FILE* f1;
+    FILE* f2;
+    unsigned char* band_1 = NULL;
+    unsigned char* band_2 = NULL;
+    unsigned char* scratch = NULL;
+    memset(&image1, 0, sizeof(BMPv3));
+    memset(&image2, 0, sizeof(BMPv3));
+    f1 = open_BMPv3_file(&image1, filename1);
+    BMP_ERROR_CHECK(stderr, -2);
+    f2 = open_BMPv3_file(&image2, filename2);
+    BMP_ERROR_CHECK(stderr, -2);
+    int result = check_images(&image1, &image2);
+    if (result == 0) {
+        ROW_COMPARISON comparison;
+        DIFF_RUNS runs;
+        memset(&runs, 0, sizeof(DIFF_RUNS));
+        set_row_comparison(&comparison, &image1, &image2, settings);
+        result = create_mask(&comparison, settings, &image2);
+        long int height = labs(image1.header.height);
+        int same_orientation = (image1.header.height < 0) == (image2.header.height < 0);
+        long int stride = get_BMPv3_row_size(&image1);
+        long int rows_per_band = stride < BMPv3_STREAM_BAND_SIZE ? BMPv3_STREAM_BAND_SIZE / stride : 1;
+        size_t scratch_size = get_scratch_size(&comparison);
+        long int count_diff = 0;
+        DIFFERENCES differences = {0, 0};
+        band_1 = (unsigned char*)malloc(rows_per_band * stride);
+        band_2 = (unsigned char*)malloc(rows_per_band * stride);
+        scratch = scratch_size > 0 ? (unsigned char*)malloc(scratch_size) : NULL;
+        int* row_mismatches = (int*)malloc(comparison.width * sizeof(int));
+        if (result == 0 && (band_1 == NULL || band_2 == NULL || row_mismatches == NULL
+                            || (scratch_size > 0 && scratch == NULL))) {
+            error("%s", "Could not allocate enough memory to compare the images");
+            result = -1;
+        }
+        Mismatch_Report* report = NULL;
+        if (result == 0 && (report = open_report(settings)) == NULL) {
+            result = -1;
+        }
+        long int first_row = 0;
+        /* A band is a run of at most rows_per_band rows none of which is known to be equal. */
+        while (result == 0 && (comparison.whole_image || count_diff < comparison.limit)) {
+            long int rows = 0;
+            while (first_row < height && is_row_known_equal(&comparison, first_row)) {
+                first_row++;
+            }
+            while (rows < rows_per_band && first_row + rows < height
+                   && !is_row_known_equal(&comparison, first_row + rows)) {
+                rows++;
+            }
+            if (rows == 0) {
+                break;
+            }
+            long int first_row_1 = same_orientation ? first_row : height - first_row - rows;
+            if (!read_rows(f1, get_BMPv3_data_offset(&image1) + first_row_1 * stride, band_1, rows * stride)
+                || !read_rows(f2, get_BMPv3_data_offset(&image2) + first_row * stride, band_2, rows * stride)) {
+                error("%s", BMP_get_status_description(BMPv3_FILE_INVALID));
+                result = -2;
+                break;
+            }
+            for (long int y = first_row; y < first_row + rows
+                                         && (comparison.whole_image || count_diff < comparison.limit); y++) {
+                long int y1 = same_orientation ? y : height - y - 1;
+                int count = compare_rows(&comparison, y, band_1 + (y1 - first_row_1) * stride,
+                                         band_2 + (y - first_row) * stride, scratch, row_mismatches,
+                                         get_row_limit(&comparison, count_diff), &differences, &runs);
+                for (int i = 0; i < count; i++) {
+                    mismatch_report_add(report, row_mismatches[i], y);
+                }
+                count_diff += count;
+            }
+            first_row += rows;
+        }
+        if (report != NULL && close_report(report, settings) != 0 && result == 0) {
+            result = -1;
+        }
+        free(row_mismatches);
+        if (result == 0 && comparison.measure) {
+            print_differences(get_samples_count(&comparison), &differences);
+        }
+        if (result == 0 && comparison.find_boxes) {
+            result = print_boxes(&runs);
+        }
+        free_diff_runs(&runs);
+        BMPv3_free(comparison.mask);
+    }
+    free(band_1);
+    free(band_2);
+    free(scratch);
+    free(image1.palette);
+    free(image2.palette);
+    fclose(f1);
+    fclose(f2);
+    return result;
+}
+
+static int hash_file(char* filename, Thread_Pool* pool, BMPv3** image, BMP_HASHES* hashes) {
+    if (bmp_hash_load(filename, hashes) == 0) {
+        return 0;
+    }
+    *image = read_BMPv3_file(filename);
+    BMP_ERROR_CHECK(stderr, -2);
+    if (bmp_hash_image(*image, pool, hashes)) {
+        return -1;
+    }
+    bmp_hash_save(filename, hashes);
+    return 0;
+}
+
+int compare_files_hashed(char* filename1, char* filename2, Thread_Pool* pool, const COMPARISON_SETTINGS* settings,
+                         int streamed) {
+    char* filenames[2] = {filename1, filename2};
+    BMPv3* images[2] = {NULL, NULL};
+    BMP_HASHES hashes[2];
+    COMPARISON_SETTINGS narrowed;
+    unsigned char* equal_tiles = NULL;
+    int result = 0;
+    memset(hashes, 0, sizeof(hashes));
+    memset(&narrowed, 0, sizeof(COMPARISON_SETTINGS));
+    if (settings != NULL) {
+        narrowed = *settings;
+    }
+    for (int i = 0; i < 2 && result == 0; i++) {
+        result = hash_file(filenames[i], pool, &images[i], &hashes[i]);
+    }
+    if (result == 0 && bmp_hash_same_tiles(&hashes[0], &hashes[1])
+        && hashes[0].image_hash == hashes[1].image_hash) {
+        if (narrowed.measure) {
+            DIFFERENCES differences = {0, 0};
+            print_differences(1, &differences);
+        }
+        if (narrowed.mask_filename != NULL) {
+            BMPv3* mask = create_diff_mask(narrowed.mask_filename, hashes[1].width, hashes[1].height);
+            if (mask == NULL) {
+                error("%s: %s\n", narrowed.mask_filename, BMP_get_error_description());
+                result = -1;
+            }
+            BMPv3_free(mask);
+        }
+    } else if (result == 0) {
+        /* Equal indices only mean equal colours under equal palettes. */
+        if (bmp_hash_same_tiles(&hashes[0], &hashes[1]) && hashes[0].palette_hash == hashes[1].palette_hash
+            && (equal_tiles = (unsigned char*)malloc(hashes[0].tiles_count > 0 ? hashes[0].tiles_count : 1)) != NULL) {
+            for (long int tile = 0; tile < hashes[0].tiles_count; tile++) {
+                equal_tiles[tile] = hashes[0].tile_hashes[tile] == hashes[1].tile_hashes[tile];
+            }
+            narrowed.equal_tiles = equal_tiles;
+            narrowed.equal_tile_rows = hashes[0].tile_rows;
+        }
+        if (streamed && (images[0] == NULL || images[1] == NULL)) {
+            result = compare_files_streamed(filename1, filename2, &narrowed);
+        } else {
+            for (int i = 0; i < 2 && result == 0; i++) {
+                if (images[i] == NULL && (images[i] = read_BMPv3_file(filenames[i])) == NULL) {
+                    error("%s\n", BMP_get_error_description());
+                    result = -2;
+                }
+            }
+            if (result == 0) {
+                result = compare_images(images[0], images[1], pool, &narrowed);
+            }
+        }
+    }
+    free(equal_tiles);
+    for (int i = 0; i < 2; i++) {
+        bmp_hash_free(&hashes[i]);
+        BMPv3_free(images[i]);
+    }
+    return result;
+}
@@ -0,0 +1,47 @@
+#include "bmp_handler.h"
+#include "mismatch_report.h"
+#include "thread_pool.h"
+
+#ifndef HOMEWORK_4_COMPARISON_H
+#define HOMEWORK_4_COMPARISON_H
+
+#define MAX_DIFF_PIXELS_COUNT 100
+
+typedef struct {
+    /* Pixels whose channels all differ by no more than this are equal. */
+    int tolerance;
+    /* Compare every row, and print the MSE, PSNR and largest channel difference to stdout. */
+    int measure;
+    /* When not NULL, the rows of every tile marked here are known to be equal and are not compared.
+       Tiles are equal_tile_rows rows each, counted from the bottom row as in bmp_hash.h. */
+    const unsigned char* equal_tiles;
+    long int equal_tile_rows;
+    /* When not NULL, an 8 bpp mask of the size and row order of the second image is written here:
+       white where pixels differ, black elsewhere. */
+    char* mask_filename;
+    /* Print the bounding box of every 8-connected region of mismatched pixels to stdout. */
+    int find_boxes;
+    /* How many mismatches are reported: 0 for MAX_DIFF_PIXELS_COUNT, -1 for all of them. */
+    long int mismatches_limit;
+    /* Where the mismatches go; NULL for "x y" lines on stderr. */
+    Mismatch_Report* report;
+} COMPARISON_SETTINGS;
+
+/* Reports the coordinates of the first mismatched pixels (MAX_DIFF_PIXELS_COUNT unless the settings
+   say otherwise) in row-major order, y counted in the row order of the second image. Indexed images
+   are compared by the colours their palettes resolve to. settings may be NULL for an exact comparison.
+   Returns -1 if the images cannot be compared, 0 otherwise. */
+int compare_images(BMPv3* image1, BMPv3* image2, Thread_Pool* pool, const COMPARISON_SETTINGS* settings);
+
+/* Same comparison as compare_images, but both files are read band by band in lockstep.
+   Returns -2 if a file cannot be read. */
+int compare_files_streamed(char* filename1, char* filename2, const COMPARISON_SETTINGS* settings);
+
+/* Compares the content hashes of the files first, taken from their sidecars when those are fresh
+   and computed (and saved to new sidecars) otherwise. Equal image hashes answer without reading
+   any more pixels; otherwise only the tiles whose hashes differ are compared, in memory or streamed.
+   Returns what compare_images or compare_files_streamed return, or -2 if a file cannot be read. */
+int compare_files_hashed(char* filename1, char* filename2, Thread_Pool* pool, const COMPARISON_SETTINGS* settings,
+                         int streamed);
+
+#endif //HOMEWORK_4_COMPARISON_H
@@ -0,0 +1,213 @@
+#include "content_hash.h"
+#include "kernel_dispatch.h"
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CONTENT_HASH_HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+#define STRIPES_PER_BLOCK 16
+#define PRIME32_1 0x9E3779B1ULL
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+
+typedef void (*accumulate_function)(CONTENT_HASH_STATE*, const unsigned char*, size_t);
+
+static const unsigned long long INITIAL_LANES[CONTENT_HASH_LANES_COUNT] = {
+    0xC2B2AE3DULL, 0x9E3779B185EBCA87ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL,
+    0x85EBCA77C2B2AE63ULL, 0x85EBCA77ULL, 0x27D4EB2F165667C5ULL, 0x9E3779B1ULL
+};
+
+/* Mixed into every stripe word before it is multiplied. */
+static const unsigned long long STRIPE_KEYS[CONTENT_HASH_LANES_COUNT] = {
+    0xBE4BA423396CFEB8ULL, 0x1CAD21F72C81017CULL, 0xDB979083E96DD4DEULL, 0x1F67B3B7A4A44072ULL,
+    0x78E5C0CC4EE679CBULL, 0x2172FFCC7DD05A82ULL, 0x8E2443F7744608B8ULL, 0x4C263A81E69035E0ULL
+};
+
+/* Mixed into the lanes when they are scrambled and when they are folded together. */
+static const unsigned long long SCRAMBLE_KEYS[CONTENT_HASH_LANES_COUNT] = {
+    0xCB00C391BB52283CULL, 0xA32E531B8B65D088ULL, 0x4EF90DA297486471ULL, 0xD8ACDEA946EF1938ULL,
+    0x3F349CE33F76FAA8ULL, 0x1D4F0BC7C7BBDCF9ULL, 0x3159B4CD4BE0518AULL, 0x647378D9C97E9FC8ULL
+};
+
+/* Each lane adds the product of the low and high halves of its keyed word, and the raw word
+   of its neighbour, so that no input word is lost when one of the halves is zero. */
+static void accumulate_portable(CONTENT_HASH_STATE* state, const unsigned char* stripes, size_t count) {
+    for (size_t s = 0; s < count; s++) {
+        for (int i = 0; i < CONTENT_HASH_LANES_COUNT; i++) {
+            unsigned long long word;
+            memcpy(&word, stripes + s * CONTENT_HASH_STRIPE_SIZE + 8 * i, 8);
+            unsigned long long keyed = word ^ STRIPE_KEYS[i];
+            state->lanes[i ^ 1] += word;
+            state->lanes[i] += (keyed & 0xFFFFFFFFULL) * (keyed >> 32);
+        }
+        if (++state->stripes_count == STRIPES_PER_BLOCK) {
+            for (int i = 0; i < CONTENT_HASH_LANES_COUNT; i++) {
+                unsigned long long lane = state->lanes[i];
+                lane ^= lane >> 47;
+                lane ^= SCRAMBLE_KEYS[i];
+                state->lanes[i] = lane * PRIME32_1;
+            }
+            state->stripes_count = 0;
+        }
+    }
+}
+
+#ifdef CONTENT_HASH_HAVE_X86
+
+/* pmuludq multiplies the low halves of 64-bit lanes, so the high halves are shifted down
+   first; pshufd swaps neighbouring words for the raw word each lane adds. */
+__attribute__((target("sse2")))
+static void accumulate_sse2(CONTENT_HASH_STATE* state, const unsigned char* stripes, size_t count) {
+    __m128i lanes[4], stripe_keys[4], scramble_keys[4];
+    __m128i prime = _mm_set1_epi32((int)PRIME32_1);
+    for (int k = 0; k < 4; k++) {
+        lanes[k] = _mm_loadu_si128((const __m128i*)(state->lanes + 2 * k));
+        stripe_keys[k] = _mm_loadu_si128((const __m128i*)(STRIPE_KEYS + 2 * k));
+        scramble_keys[k] = _mm_loadu_si128((const __m128i*)(SCRAMBLE_KEYS + 2 * k));
+    }
+    for (size_t s = 0; s < count; s++) {
+        for (int k = 0; k < 4; k++) {
+            __m128i word = _mm_loadu_si128((const __m128i*)(stripes + s * CONTENT_HASH_STRIPE_SIZE + 16 * k));
+            __m128i keyed = _mm_xor_si128(word, stripe_keys[k]);
+            __m128i product = _mm_mul_epu32(keyed, _mm_srli_epi64(keyed, 32));
+            __m128i swapped = _mm_shuffle_epi32(word, _MM_SHUFFLE(1, 0, 3, 2));
+            lanes[k] = _mm_add_epi64(lanes[k], _mm_add_epi64(product, swapped));
+        }
+        if (++state->stripes_count == STRIPES_PER_BLOCK) {
+            for (int k = 0; k < 4; k++) {
+                __m128i lane = _mm_xor_si128(lanes[k], _mm_srli_epi64(lanes[k], 47));
+                lane = _mm_xor_si128(lane, scramble_keys[k]);
+                __m128i low = _mm_mul_epu32(lane, prime);
+                __m128i high = _mm_mul_epu32(_mm_srli_epi64(lane, 32), prime);
+                lanes[k] = _mm_add_epi64(low, _mm_slli_epi64(high, 32));
+            }
+            state->stripes_count = 0;
+        }
+    }
+    for (int k = 0; k < 4; k++) {
+        _mm_storeu_si128((__m128i*)(state->lanes + 2 * k), lanes[k]);
+    }
+}
+
+__attribute__((target("avx2")))
+static void accumulate_avx2(CONTENT_HASH_STATE* state, const unsigned char* stripes, size_t count) {
+    __m256i lanes[2], stripe_keys[2], scramble_keys[2];
+    __m256i prime = _mm256_set1_epi32((int)PRIME32_1);
+    for (int k = 0; k < 2; k++) {
+        lanes[k] = _mm256_loadu_si256((const __m256i*)(state->lanes + 4 * k));
+        stripe_keys[k] = _mm256_loadu_si256((const __m256i*)(STRIPE_KEYS + 4 * k));
+        scramble_keys[k] = _mm256_loadu_si256((const __m256i*)(SCRAMBLE_KEYS + 4 * k));
+    }
+    for (size_t s = 0; s < count; s++) {
+        for (int k = 0; k < 2; k++) {
+            __m256i word = _mm256_loadu_si256((const __m256i*)(stripes + s * CONTENT_HASH_STRIPE_SIZE + 32 * k));
+            __m256i keyed = _mm256_xor_si256(word, stripe_keys[k]);
+            __m256i product = _mm256_mul_epu32(keyed, _mm256_srli_epi64(keyed, 32));
+            __m256i swapped = _mm256_shuffle_epi32(word, _MM_SHUFFLE(1, 0, 3, 2));
+            lanes[k] = _mm256_add_epi64(lanes[k], _mm256_add_epi64(product, swapped));
+        }
+        if (++state->stripes_count == STRIPES_PER_BLOCK) {
+            for (int k = 0; k < 2; k++) {
+                __m256i lane = _mm256_xor_si256(lanes[k], _mm256_srli_epi64(lanes[k], 47));
+                lane = _mm256_xor_si256(lane, scramble_keys[k]);
+                __m256i low = _mm256_mul_epu32(lane, prime);
+                __m256i high = _mm256_mul_epu32(_mm256_srli_epi64(lane, 32), prime);
+                lanes[k] = _mm256_add_epi64(low, _mm256_slli_epi64(high, 32));
+            }
+            state->stripes_count = 0;
+        }
+    }
+    for (int k = 0; k < 2; k++) {
+        _mm256_storeu_si256((__m256i*)(state->lanes + 4 * k), lanes[k]);
+    }
+}
+
+#endif
+
+static KERNEL_CHOICE choose_accumulate_kernel() {
+    KERNEL_CHOICE choice = {(kernel_function)accumulate_portable, "portable"};
+#ifdef CONTENT_HASH_HAVE_X86
+    if (__builtin_cpu_supports("avx2")) {
+        choice.function = (kernel_function)accumulate_avx2;
+        choice.name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        choice.function = (kernel_function)accumulate_sse2;
+        choice.name = "sse2";
+    }
+#endif
+    return choice;
+}
+
+static KERNEL_DISPATCH ACCUMULATE_KERNEL = KERNEL_DISPATCH_INITIALIZER(choose_accumulate_kernel);
+
+static void accumulate(CONTENT_HASH_STATE* state, const unsigned char* stripes, size_t count) {
+    ((accumulate_function)kernel_dispatch_get(&ACCUMULATE_KERNEL))(state, stripes, count);
+}
+
+void content_hash_begin(CONTENT_HASH_STATE* state) {
+    memcpy(state->lanes, INITIAL_LANES, sizeof(INITIAL_LANES));
+    state->buffered_size = 0;
+    state->length = 0;
+    state->stripes_count = 0;
+}
+
+/* Whole stripes are accumulated straight from data; only the pieces of stripes split between
+   calls go through the buffer. */
+void content_hash_update(CONTENT_HASH_STATE* state, const void* data, size_t size) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    state->length += size;
+    if (state->buffered_size > 0) {
+        size_t copied = CONTENT_HASH_STRIPE_SIZE - state->buffered_size;
+        if (copied > size) {
+            copied = size;
+        }
+        memcpy(state->buffer + state->buffered_size, bytes, copied);
+        state->buffered_size += copied;
+        bytes += copied;
+        size -= copied;
+        if (state->buffered_size < CONTENT_HASH_STRIPE_SIZE) {
+            return;
+        }
+        accumulate(state, state->buffer, 1);
+        state->buffered_size = 0;
+    }
+    size_t stripes_count = size / CONTENT_HASH_STRIPE_SIZE;
+    accumulate(state, bytes, stripes_count);
+    bytes += stripes_count * CONTENT_HASH_STRIPE_SIZE;
+    size -= stripes_count * CONTENT_HASH_STRIPE_SIZE;
+    memcpy(state->buffer, bytes, size);
+    state->buffered_size = size;
+}
+
+static unsigned long long multiply_and_fold(unsigned long long first, unsigned long long second) {
+    unsigned __int128 product = (unsigned __int128)first * second;
+    return (unsigned long long)product ^ (unsigned long long)(product >> 64);
+}
+
+/* The last partial stripe is padded with zeros; the length tells it apart from real zeros. */
+unsigned long long content_hash_end(CONTENT_HASH_STATE* state) {
+    unsigned long long hash = state->length * PRIME64_1;
+    if (state->buffered_size > 0) {
+        memset(state->buffer + state->buffered_size, 0, CONTENT_HASH_STRIPE_SIZE - state->buffered_size);
+        accumulate(state, state->buffer, 1);
+        state->buffered_size = 0;
+    }
+    for (int i = 0; i < CONTENT_HASH_LANES_COUNT; i += 2) {
+        hash += multiply_and_fold(state->lanes[i] ^ SCRAMBLE_KEYS[i], state->lanes[i + 1] ^ SCRAMBLE_KEYS[i + 1]);
+    }
+    hash ^= hash >> 37;
+    hash *= 0x165667919E3779F9ULL;
+    return hash ^ (hash >> 32);
+}
+
+unsigned long long content_hash(const void* data, size_t size) {
+    CONTENT_HASH_STATE state;
+    content_hash_begin(&state);
+    content_hash_update(&state, data, size);
+    return content_hash_end(&state);
+}
+
+const char* content_hash_implementation() {
+    return kernel_dispatch_name(&ACCUMULATE_KERNEL);
+}
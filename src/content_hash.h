@@ -0,0 +1,31 @@
+#include <stddef.h>
+
+#ifndef HOMEWORK_4_CONTENT_HASH_H
+#define HOMEWORK_4_CONTENT_HASH_H
+
+#define CONTENT_HASH_LANES_COUNT 8
+#define CONTENT_HASH_STRIPE_SIZE 64
+
+/* 64-bit non-cryptographic hash in the style of XXH3: eight 64-bit lanes take a 64-byte stripe
+   at a time and are scrambled every 16 stripes, then folded together with the length. Data may
+   be fed in pieces of any size; the result only depends on the concatenated bytes. */
+typedef struct {
+    unsigned long long lanes[CONTENT_HASH_LANES_COUNT];
+    unsigned char buffer[CONTENT_HASH_STRIPE_SIZE];
+    size_t buffered_size;
+    unsigned long long length;
+    int stripes_count;
+} CONTENT_HASH_STATE;
+
+void content_hash_begin(CONTENT_HASH_STATE* state);
+
+void content_hash_update(CONTENT_HASH_STATE* state, const void* data, size_t size);
+
+unsigned long long content_hash_end(CONTENT_HASH_STATE* state);
+
+unsigned long long content_hash(const void* data, size_t size);
+
+/* Name of the kernel the stripes are accumulated with, e.g. "avx2". All kernels give the same hashes. */
+const char* content_hash_implementation();
+
+#endif //HOMEWORK_4_CONTENT_HASH_H
@@ -1,14 +1,20 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include "bmp_handler.h"
+#include "batch.h"
+#include "bmp_pipeline.h"
+#include "negation.h"
+#include "transform.h"
+#include "thread_pool.h"
+#include "stats.h"
 #include "qdbmp.h"
 
 #define NORMAL_ARGUMENTS_COUNT 3
 #define error(...) (fprintf(stderr, __VA_ARGS__))
-#define BYTES_COUNT_IN_PIXEL 3
-#define PALETTE_SIZE_8bbp (256 * 4)
 #define MAX_FILENAME_SIZE 255
+#define TILE_SIZE (256 * 1024)
 
 int is_filename_incorrect(char* filename, char* key) {
     unsigned int filename_length = strlen(filename);
@@ -26,82 +32,455 @@ typedef enum {
     THEIRS
 } REALIZATION_TYPE;
 
-int scan_arguments(int count_of_arguments, char** arguments, REALIZATION_TYPE* realization,
-                   char* input_filename, char* output_filename) {
-    if (count_of_arguments - 1 != NORMAL_ARGUMENTS_COUNT) {
-        error("%s", "Count of arguments must be 3");
+typedef enum {
+    IO_BUFFERED,
+    IO_MAPPED,
+    IO_STREAMED,
+    IO_PIPELINED
+} IO_MODE;
+
+typedef struct {
+    REALIZATION_TYPE realization;
+    IO_MODE io_mode;
+    BMPv3_PIPELINE_BACKEND pipeline_backend;
+    int threads_count;
+    int batch;
+    int huge_pages;
+    int aligned_rows;
+    int in_place;
+    int stats;
+    STATS_FORMAT stats_format;
+    TRANSFORM_CHAIN transforms;
+    char* manifest_filename;
+    char input_filename[MAX_FILENAME_SIZE];
+    char output_filename[MAX_FILENAME_SIZE];
+} CONVERTER_OPTIONS;
+
+int set_io_mode(CONVERTER_OPTIONS* options, IO_MODE io_mode) {
+    if (options->io_mode != IO_BUFFERED && options->io_mode != io_mode) {
+        error("%s", "Options --mmap, --stream and --pipeline cannot be combined");
+        return 1;
+    }
+    options->io_mode = io_mode;
+    return 0;
+}
+
+int scan_threads_count(char* argument, int* threads_count) {
+    char* end;
+    long int value = strtol(argument, &end, 10);
+    if (*argument == '\0' || *end != '\0' || value < 1 || value > MAX_THREADS_COUNT) {
+        error("Count of threads must be a number from 1 to %d", MAX_THREADS_COUNT);
+        return 1;
+    }
+    *threads_count = (int)value;
+    return 0;
+}
+
+int scan_arguments(int count_of_arguments, char** arguments, CONVERTER_OPTIONS* options) {
+    memset(options, 0, sizeof(CONVERTER_OPTIONS));
+    options->threads_count = 1;
+    if (count_of_arguments - 1 < NORMAL_ARGUMENTS_COUNT) {
+        error("%s", "Count of arguments must be at least 3");
         return 1;
     }
     if (strcmp(arguments[1], "--mine") == 0) {
-        *realization = MINE;
+        options->realization = MINE;
     } else if (strcmp(arguments[1], "--theirs") == 0) {
-        *realization = THEIRS;
+        options->realization = THEIRS;
     } else {
         error("%s", "Incorrect type of realization");
         return 1;
     }
-    strcpy(input_filename, arguments[2]);
-    strcpy(output_filename, arguments[3]);
-    if (is_filename_incorrect(input_filename, ".bmp") || is_filename_incorrect(output_filename, ".bmp")) {
+    int i = 2;
+    for (; i < count_of_arguments && strncmp(arguments[i], "--", 2) == 0; i++) {
+        if (strcmp(arguments[i], "--mmap") == 0) {
+            if (set_io_mode(options, IO_MAPPED)) {
+                return 1;
+            }
+        } else if (strcmp(arguments[i], "--stream") == 0) {
+            if (set_io_mode(options, IO_STREAMED)) {
+                return 1;
+            }
+        } else if (strcmp(arguments[i], "--pipeline") == 0 || strcmp(arguments[i], "--pipeline=threads") == 0) {
+            if (set_io_mode(options, IO_PIPELINED)) {
+                return 1;
+            }
+            options->pipeline_backend = arguments[i][10] == '=' ? BMPv3_PIPELINE_THREADS : BMPv3_PIPELINE_AUTO;
+        } else if (strcmp(arguments[i], "--threads") == 0 && i + 1 < count_of_arguments) {
+            if (scan_threads_count(arguments[++i], &options->threads_count)) {
+                return 1;
+            }
+        } else if (strcmp(arguments[i], "--op") == 0 && i + 1 < count_of_arguments) {
+            if (add_transform_op(&options->transforms, arguments[++i])) {
+                return 1;
+            }
+        } else if (strcmp(arguments[i], "--batch") == 0) {
+            options->batch = 1;
+        } else if (strcmp(arguments[i], "--huge-pages") == 0) {
+            options->huge_pages = 1;
+        } else if (strcmp(arguments[i], "--aligned") == 0) {
+            options->aligned_rows = 1;
+        } else if (strcmp(arguments[i], "--in-place") == 0) {
+            options->in_place = 1;
+        } else if (strcmp(arguments[i], "--stats") == 0 || strcmp(arguments[i], "--stats=json") == 0) {
+            options->stats = 1;
+            options->stats_format = arguments[i][7] == '=' ? STATS_JSON : STATS_TEXT;
+        } else {
+            error("Unknown option %s", arguments[i]);
+            return 1;
+        }
+    }
+    if (options->realization == THEIRS && (options->io_mode != IO_BUFFERED || options->batch)) {
+        error("%s", "Options --mmap, --stream, --pipeline and --batch are supported only by --mine");
+        return 1;
+    }
+    if (options->in_place) {
+        if (options->realization == THEIRS || options->io_mode != IO_BUFFERED || options->batch) {
+            error("%s", "Option --in-place is supported only by --mine without --mmap, --stream, --pipeline and --batch");
+            return 1;
+        }
+        if (count_of_arguments - i != 1) {
+            error("%s", "In-place mode needs exactly one file name after the options");
+            return 1;
+        }
+        strcpy(options->input_filename, arguments[i]);
+        if (is_filename_incorrect(options->input_filename, ".bmp")) {
+            error("%s", "File must be in bmp format");
+            return 1;
+        }
+        return 0;
+    }
+    if (options->batch) {
+        if (options->io_mode != IO_BUFFERED) {
+            error("%s", "Option --batch cannot be combined with --mmap, --stream or --pipeline");
+            return 1;
+        }
+        if (count_of_arguments - i == 1) {
+            options->manifest_filename = arguments[i];
+        } else if (count_of_arguments - i == 2) {
+            strcpy(options->input_filename, arguments[i]);
+            strcpy(options->output_filename, arguments[i + 1]);
+        } else {
+            error("%s", "Batch mode needs a manifest file or an input and an output directory");
+            return 1;
+        }
+        return 0;
+    }
+    if (count_of_arguments - i != 2) {
+        error("%s", "Input and output file names must follow the options");
+        return 1;
+    }
+    strcpy(options->input_filename, arguments[i]);
+    strcpy(options->output_filename, arguments[i + 1]);
+    if (is_filename_incorrect(options->input_filename, ".bmp")
+        || is_filename_incorrect(options->output_filename, ".bmp")) {
         error("%s", "File must be in bmp format");
         return 1;
     }
     return 0;
 }
 
-int main(int argc, char* argv[]) {
-    REALIZATION_TYPE realization;
-    char input_filename[MAX_FILENAME_SIZE];
-    char output_filename[MAX_FILENAME_SIZE];
-    if (scan_arguments(argc, argv, &realization, input_filename, output_filename)) {
-        return -1;
-    }
-    if (realization == MINE) {
-        BMPv3* image = read_BMPv3_file(input_filename);
-        BMP_ERROR_CHECK(stderr, -2);
-        if (image->header.bits_per_pixel == 24) {
-            for (unsigned long int i = 0; i < image->header.width * image->header.height * BYTES_COUNT_IN_PIXEL; i++) {
-                image->data[i] = ~image->data[i];
-            }
-        }
-        else if (image->header.bits_per_pixel == 8) {
-            for (int i = 0; i < PALETTE_SIZE_8bbp; i++) {
-                if ((i + 1) % 4 != 0) {
-                    image->palette[i] = ~image->palette[i];
-                }
-            }
-        }
-        else {
-            error("%s", "File is not a supported BMP variant");
-            return -1;
-        }
-        write_BMPv3_file(image, output_filename);
-        BMP_ERROR_CHECK(stderr, -1);
-    } else if (realization == THEIRS) {
-        BMP* image = BMP_ReadFile(input_filename);
-        BMP_CHECK_ERROR(stdout, -2);
-        unsigned long int width = BMP_GetWidth(image);
-        unsigned long int height = BMP_GetHeight(image);
-        unsigned char r, g, b;
-        if (image->Header.BitsPerPixel == 24) {
-            for (unsigned long int x = 0; x < width; ++x) {
-                for (unsigned long int y = 0 ;y < height; ++y) {
-                    BMP_GetPixelRGB(image, x, y, &r, &g, &b);
-                    BMP_SetPixelRGB(image, x, y, 255 - r, 255 - g, 255 - b);
-                }
-            }
-        } else if (image->Header.BitsPerPixel == 8) {
-            for (int i = 0; i < PALETTE_SIZE_8bbp; i++) {
-                if ((i + 1) % 4 != 0) {
-                    image->Palette[i] = ~image->Palette[i];
-                }
-            }
+/* 4 and 8 bpp pixels are palette indices, so only the palette is transformed. */
+int is_indexed(int bits_per_pixel) {
+    return bits_per_pixel <= 8;
+}
+
+int get_colors_count(int bits_per_pixel) {
+    return 1 << bits_per_pixel;
+}
+
+void transform_image_palette(TRANSFORM_CHAIN* chain, unsigned char* palette, int bits_per_pixel) {
+    STATS_SCOPE(STATS_TRANSFORM);
+    STATS_COUNT(STATS_TRANSFORM, 4 * get_colors_count(bits_per_pixel));
+    transform_palette(chain, palette, get_colors_count(bits_per_pixel));
+}
+
+/* What every conversion path needs: the worker threads and the chain of ops to run. */
+typedef struct {
+    Thread_Pool* pool;
+    TRANSFORM_CHAIN* chain;
+} CONVERSION;
+
+typedef struct {
+    const TRANSFORM_CHAIN* chain;
+    unsigned char* destination;
+    const unsigned char* source;
+    long int stride;
+    long int width;
+    int pixel_size;
+} TRANSFORM_JOB;
+
+void transform_tile(long int begin, long int end, void* context) {
+    TRANSFORM_JOB* job = (TRANSFORM_JOB*)context;
+    if (is_plain_negation(job->chain)) {
+        if (job->pixel_size == 4) {
+            negate_bgra_pixels(job->destination + begin, job->source + begin, end - begin);
         } else {
-            error("%s", "File is not a supported BMP variant");
-            return -1;
+            negate_bytes(job->destination + begin, job->source + begin, end - begin);
         }
-        BMP_WriteFile(image, output_filename);
-        BMP_CHECK_ERROR(stdout, -1);
+        return;
+    }
+    for (long int row = begin; row < end; row += job->stride) {
+        /* The last band of a stream may end inside a row when the pixel data is cut short. */
+        long int width = (end - row) / job->pixel_size < job->width ? (end - row) / job->pixel_size : job->width;
+        transform_pixels(job->chain, job->destination + row, job->source + row, width, job->pixel_size);
+    }
+}
+
+/* Transforms size bytes of 24 or 32 bpp pixel data, rows stride bytes apart, in tiles of whole rows
+   spread over the pool. A plain negation runs over the padding too; other chains leave it alone. */
+void transform_pixel_data(CONVERSION* conversion, unsigned char* destination, const unsigned char* source,
+                          long int size, long int stride, long int width, int bits_per_pixel) {
+    STATS_SCOPE(STATS_TRANSFORM);
+    STATS_COUNT(STATS_TRANSFORM, size);
+    TRANSFORM_JOB job = {conversion->chain, destination, source, stride, width, bits_per_pixel / 8};
+    long int rows_per_tile = stride < TILE_SIZE ? TILE_SIZE / stride : 1;
+    thread_pool_run(conversion->pool, size, rows_per_tile * stride, transform_tile, &job);
+}
+
+int transform_image(BMPv3* image, void* context) {
+    CONVERSION* conversion = (CONVERSION*)context;
+    if (is_indexed(image->header.bits_per_pixel)) {
+        transform_image_palette(conversion->chain, image->palette, image->header.bits_per_pixel);
+    } else if (image->header.bits_per_pixel == 24 || image->header.bits_per_pixel == 32) {
+        long int stride = get_BMPv3_stride(image);
+        long int size = stride != get_BMPv3_row_size(image)
+                        ? stride * labs(image->header.height) : image->header.image_data_size;
+        transform_pixel_data(conversion, image->data, image->data, size, stride, image->header.width,
+                             image->header.bits_per_pixel);
+    } else {
+        error("%s", "File is not a supported BMP variant");
+        return -1;
+    }
+    return 0;
+}
+
+typedef struct {
+    CONVERSION* conversion;
+    int bits_per_pixel;
+    long int row_size;
+    long int width;
+} STREAM_TRANSFORM;
+
+void prepare_stream_transform(BMPv3* bmp, void* context) {
+    STREAM_TRANSFORM* transform = (STREAM_TRANSFORM*)context;
+    transform->bits_per_pixel = bmp->header.bits_per_pixel;
+    transform->row_size = get_BMPv3_row_size(bmp);
+    transform->width = bmp->header.width;
+    if (is_indexed(bmp->header.bits_per_pixel)) {
+        transform_image_palette(transform->conversion->chain, bmp->palette, bmp->header.bits_per_pixel);
+    }
+}
+
+void transform_stream_band(unsigned char* band, size_t band_size, void* context) {
+    STREAM_TRANSFORM* transform = (STREAM_TRANSFORM*)context;
+    if (!is_indexed(transform->bits_per_pixel)) {
+        transform_pixel_data(transform->conversion, band, band, band_size, transform->row_size, transform->width,
+                             transform->bits_per_pixel);
+    }
+}
+
+/* Only the palette of a 4 or 8 bpp image changes: the header and the new palette are written
+   and the pixel indices are copied from file to file inside the kernel. */
+int convert_mine_indexed(char* input_filename, char* output_filename, CONVERSION* conversion) {
+    STREAM_TRANSFORM transform = {conversion, 0, 0, 0};
+    BMPv3_Stream_Handler handler = {prepare_stream_transform, NULL, &transform};
+    stream_BMPv3_file(input_filename, output_filename, &handler);
+    int return_value = BMP_get_error() == BMPv3_IO_ERROR ? -1 : -2;
+    BMP_ERROR_CHECK(stderr, return_value);
+    return 0;
+}
+
+int convert_mine(char* input_filename, char* output_filename, CONVERSION* conversion) {
+    BMPv3_Header header;
+    if (probe_BMPv3_file(input_filename, &header) == BMPv3_OK && is_indexed(header.bits_per_pixel)) {
+        return convert_mine_indexed(input_filename, output_filename, conversion);
+    }
+    BMPv3* image = read_BMPv3_file(input_filename);
+    BMP_ERROR_CHECK(stderr, -2);
+    if (transform_image(image, conversion)) {
+        return -1;
+    }
+    write_BMPv3_file(image, output_filename);
+    BMP_ERROR_CHECK(stderr, -1);
+    BMPv3_free(image);
+    return 0;
+}
+
+int convert_batch(CONVERTER_OPTIONS* options, CONVERSION* conversion) {
+    BATCH batch = {NULL, 0, 0};
+    int failed_count;
+    if (options->manifest_filename != NULL
+        ? read_batch_manifest(options->manifest_filename, &batch)
+        : read_batch_directory(options->input_filename, options->output_filename, &batch)) {
+        free_batch(&batch);
+        return -1;
+    }
+    failed_count = run_batch(&batch, transform_image, conversion);
+    if (failed_count > 0) {
+        error("%d of %d files were not converted\n", failed_count, batch.count);
+    }
+    free_batch(&batch);
+    return failed_count > 0 ? -1 : 0;
+}
+
+int convert_mine_mapped(char* input_filename, char* output_filename, CONVERSION* conversion) {
+    BMPv3* input = map_BMPv3_file(input_filename);
+    BMP_ERROR_CHECK(stderr, -2);
+    BMPv3* output = create_mapped_BMPv3_file(&input->header, output_filename);
+    BMP_ERROR_CHECK(stderr, -1);
+    if (is_indexed(input->header.bits_per_pixel)) {
+        memcpy(output->palette, input->palette, get_BMPv3_palette_size(input));
+        transform_image_palette(conversion->chain, output->palette, input->header.bits_per_pixel);
+        memcpy(output->data, input->data, input->header.image_data_size);
+    } else {
+        transform_pixel_data(conversion, output->data, input->data, input->header.image_data_size,
+                             get_BMPv3_row_size(input), input->header.width, input->header.bits_per_pixel);
+    }
+    unmap_BMPv3_file(input);
+    unmap_BMPv3_file(output);
+    BMP_ERROR_CHECK(stderr, -1);
+    return 0;
+}
+
+int convert_mine_streamed(char* input_filename, char* output_filename, CONVERSION* conversion) {
+    BMPv3_Header header;
+    if (probe_BMPv3_file(input_filename, &header) == BMPv3_OK && is_indexed(header.bits_per_pixel)) {
+        return convert_mine_indexed(input_filename, output_filename, conversion);
+    }
+    STREAM_TRANSFORM transform = {conversion, 0, 0, 0};
+    BMPv3_Stream_Handler handler = {prepare_stream_transform, transform_stream_band, &transform};
+    stream_BMPv3_file(input_filename, output_filename, &handler);
+    int return_value = BMP_get_error() == BMPv3_IO_ERROR ? -1 : -2;
+    BMP_ERROR_CHECK(stderr, return_value);
+    return 0;
+}
+
+int convert_mine_pipelined(char* input_filename, char* output_filename, CONVERSION* conversion,
+                           BMPv3_PIPELINE_BACKEND backend) {
+    BMPv3_Header header;
+    if (probe_BMPv3_file(input_filename, &header) == BMPv3_OK && is_indexed(header.bits_per_pixel)) {
+        return convert_mine_indexed(input_filename, output_filename, conversion);
     }
+    STREAM_TRANSFORM transform = {conversion, 0, 0, 0};
+    BMPv3_Stream_Handler handler = {prepare_stream_transform, transform_stream_band, &transform};
+    BMPv3_STATUS status = pipeline_BMPv3_file(input_filename, output_filename, &handler, backend);
+    if (status != BMPv3_OK) {
+        error("%s\n", BMP_get_status_description(status));
+        return status == BMPv3_IO_ERROR ? -1 : -2;
+    }
+    return 0;
+}
+
+int convert_mine_in_place(char* filename, CONVERSION* conversion) {
+    BMPv3_Header header;
+    STREAM_TRANSFORM transform = {conversion, 0, 0, 0};
+    BMPv3_Stream_Handler handler = {prepare_stream_transform, transform_stream_band, &transform};
+    if (probe_BMPv3_file(filename, &header) == BMPv3_OK && is_indexed(header.bits_per_pixel)) {
+        handler.process_band = NULL;
+    }
+    patch_BMPv3_file(filename, &handler);
+    int return_value = BMP_get_error() == BMPv3_IO_ERROR ? -1 : -2;
+    BMP_ERROR_CHECK(stderr, return_value);
     return 0;
 }
+
+void transform_theirs_row(UCHAR* row, UINT width, USHORT depth, void* chain) {
+    transform_pixels((TRANSFORM_CHAIN*)chain, row, row, width, depth / 8);
+}
+
+typedef struct {
+    BMP* image;
+    TRANSFORM_CHAIN* chain;
+} THEIRS_JOB;
+
+void transform_theirs_rows(long int begin, long int end, void* context) {
+    THEIRS_JOB* job = (THEIRS_JOB*)context;
+    BMP_TransformRows(job->image, begin, end - begin, transform_theirs_row, job->chain);
+}
+
+BMP* read_theirs(char* filename) {
+    STATS_SCOPE(STATS_READ);
+    BMP* image = BMP_ReadFile(filename);
+    if (image != NULL) {
+        STATS_COUNT(STATS_READ, image->Header.FileSize);
+    }
+    return image;
+}
+
+void write_theirs(BMP* image, char* filename) {
+    STATS_SCOPE(STATS_WRITE);
+    STATS_COUNT(STATS_WRITE, image->Header.FileSize);
+    BMP_WriteFile(image, filename);
+}
+
+void transform_theirs_pixels(BMP* image, CONVERSION* conversion) {
+    STATS_SCOPE(STATS_TRANSFORM);
+    STATS_COUNT(STATS_TRANSFORM, image->Header.ImageDataSize);
+    THEIRS_JOB job = {image, conversion->chain};
+    long int row_size = BMP_GetWidth(image) * (image->Header.BitsPerPixel / 8);
+    thread_pool_run(conversion->pool, BMP_GetHeight(image), row_size < TILE_SIZE ? TILE_SIZE / row_size : 1,
+                    transform_theirs_rows, &job);
+}
+
+int convert_theirs(char* input_filename, char* output_filename, CONVERSION* conversion) {
+    BMP* image = read_theirs(input_filename);
+    BMP_CHECK_ERROR(stdout, -2);
+    if (image->Header.BitsPerPixel == 24 || image->Header.BitsPerPixel == 32) {
+        transform_theirs_pixels(image, conversion);
+    } else if (is_indexed(image->Header.BitsPerPixel)) {
+        transform_image_palette(conversion->chain, image->Palette, image->Header.BitsPerPixel);
+    } else {
+        error("%s", "File is not a supported BMP variant");
+        return -1;
+    }
+    write_theirs(image, output_filename);
+    BMP_CHECK_ERROR(stdout, -1);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    CONVERTER_OPTIONS options;
+    CONVERSION conversion;
+    TRANSFORM_CHAIN chain;
+    int result;
+    if (scan_arguments(argc, argv, &options)) {
+        return -1;
+    }
+    if (options.stats && !stats_enable(options.stats_format)) {
+        error("%s", "Option --stats needs a build configured with -DBMP_STATS=ON");
+        return -1;
+    }
+    if (options.transforms.count == 0) {
+        add_transform_op(&options.transforms, "negate");
+    }
+    BMPv3_use_huge_pages(options.huge_pages);
+    BMPv3_use_aligned_rows(options.aligned_rows);
+    compile_transform_chain(&options.transforms, &chain);
+    conversion.chain = &chain;
+    conversion.pool = thread_pool_create(options.threads_count);
+    if (conversion.pool == NULL) {
+        error("%s", "Could not start the worker threads");
+        return -1;
+    }
+    if (options.batch) {
+        result = convert_batch(&options, &conversion);
+    } else if (options.in_place) {
+        result = convert_mine_in_place(options.input_filename, &conversion);
+    } else if (options.realization == THEIRS) {
+        result = convert_theirs(options.input_filename, options.output_filename, &conversion);
+    } else if (options.io_mode == IO_MAPPED) {
+        result = convert_mine_mapped(options.input_filename, options.output_filename, &conversion);
+    } else if (options.io_mode == IO_PIPELINED) {
+        result = convert_mine_pipelined(options.input_filename, options.output_filename, &conversion,
+                                        options.pipeline_backend);
+    } else if (options.io_mode == IO_STREAMED) {
+        result = convert_mine_streamed(options.input_filename, options.output_filename, &conversion);
+    } else {
+        result = convert_mine(options.input_filename, options.output_filename, &conversion);
+    }
+    thread_pool_destroy(conversion.pool);
+    BMPv3_pool_clear();
+    stats_print();
+    return result;
+}
@@ -0,0 +1,144 @@
+#include "diff_regions.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define BMP_MAGIC 0x4D42
+#define INFO_HEADER_SIZE 40
+#define MASK_COLORS_COUNT 256
+
+void add_diff_run(DIFF_RUNS* runs, int x_begin, int x_end, long int y) {
+    if (runs->out_of_memory) {
+        return;
+    }
+    if (runs->count == runs->capacity) {
+        long int capacity = runs->capacity > 0 ? runs->capacity * 2 : 256;
+        DIFF_RUN* grown = (DIFF_RUN*)realloc(runs->runs, capacity * sizeof(DIFF_RUN));
+        if (grown == NULL) {
+            runs->out_of_memory = 1;
+            return;
+        }
+        runs->runs = grown;
+        runs->capacity = capacity;
+    }
+    runs->runs[runs->count].x_begin = x_begin;
+    runs->runs[runs->count].x_end = x_end;
+    runs->runs[runs->count].y = y;
+    runs->count++;
+}
+
+void append_diff_runs(DIFF_RUNS* destination, const DIFF_RUNS* source) {
+    destination->out_of_memory |= source->out_of_memory;
+    for (long int i = 0; i < source->count && !destination->out_of_memory; i++) {
+        add_diff_run(destination, source->runs[i].x_begin, source->runs[i].x_end, source->runs[i].y);
+    }
+}
+
+void free_diff_runs(DIFF_RUNS* runs) {
+    free(runs->runs);
+    memset(runs, 0, sizeof(DIFF_RUNS));
+}
+
+static long int find_root(long int* parents, long int run) {
+    while (parents[run] != run) {
+        parents[run] = parents[parents[run]];
+        run = parents[run];
+    }
+    return run;
+}
+
+/* The root with the smaller index is kept, so every region is rooted at its first run. */
+static void join_runs(long int* parents, long int first, long int second) {
+    first = find_root(parents, first);
+    second = find_root(parents, second);
+    if (first < second) {
+        parents[second] = first;
+    } else if (second < first) {
+        parents[first] = second;
+    }
+}
+
+long int find_diff_boxes(const DIFF_RUNS* runs, DIFF_BOX** boxes) {
+    const DIFF_RUN* run = runs->runs;
+    long int* parents = (long int*)malloc((runs->count > 0 ? runs->count : 1) * sizeof(long int));
+    long int* box_of_root = (long int*)malloc((runs->count > 0 ? runs->count : 1) * sizeof(long int));
+    long int boxes_count = 0;
+    *boxes = NULL;
+    if (parents == NULL || box_of_root == NULL) {
+        free(parents);
+        free(box_of_root);
+        return -1;
+    }
+    /* previous_begin..current_begin are the runs of the row above the current one. */
+    long int previous_begin = 0, current_begin = 0;
+    for (long int i = 0; i < runs->count; i++) {
+        parents[i] = i;
+        if (i == 0 || run[i].y != run[i - 1].y) {
+            previous_begin = i > 0 && run[i - 1].y == run[i].y - 1 ? current_begin : i;
+            current_begin = i;
+        }
+        /* Runs of the row above that end before this one starts can only touch later runs less. */
+        while (previous_begin < current_begin && run[previous_begin].x_end < run[i].x_begin) {
+            previous_begin++;
+        }
+        for (long int k = previous_begin; k < current_begin && run[k].x_begin <= run[i].x_end; k++) {
+            join_runs(parents, k, i);
+        }
+    }
+    *boxes = (DIFF_BOX*)malloc((runs->count > 0 ? runs->count : 1) * sizeof(DIFF_BOX));
+    if (*boxes == NULL) {
+        free(parents);
+        free(box_of_root);
+        return -1;
+    }
+    for (long int i = 0; i < runs->count; i++) {
+        long int root = find_root(parents, i);
+        DIFF_BOX* box;
+        if (root == i) {
+            box_of_root[i] = boxes_count++;
+            box = &(*boxes)[box_of_root[i]];
+            box->x_first = run[i].x_begin;
+            box->x_last = run[i].x_end - 1;
+            box->y_first = box->y_last = run[i].y;
+            box->pixels_count = 0;
+        } else {
+            box = &(*boxes)[box_of_root[root]];
+        }
+        if (run[i].x_begin < box->x_first) {
+            box->x_first = run[i].x_begin;
+        }
+        if (run[i].x_end - 1 > box->x_last) {
+            box->x_last = run[i].x_end - 1;
+        }
+        if (run[i].y > box->y_last) {
+            box->y_last = run[i].y;
+        }
+        box->pixels_count += run[i].x_end - run[i].x_begin;
+    }
+    free(parents);
+    free(box_of_root);
+    return boxes_count;
+}
+
+BMPv3* create_diff_mask(char* filename, long int width, long int height) {
+    BMPv3 mask;
+    memset(&mask, 0, sizeof(BMPv3));
+    mask.header.magic = BMP_MAGIC;
+    mask.header.header_size = INFO_HEADER_SIZE;
+    mask.header.width = width;
+    mask.header.height = height;
+    mask.header.planes = 1;
+    mask.header.bits_per_pixel = 8;
+    mask.header.image_data_size = get_BMPv3_row_size(&mask) * labs(height);
+    mask.header.data_offset = get_BMPv3_data_offset(&mask);
+    mask.header.file_size = mask.header.data_offset + mask.header.image_data_size;
+    mask.header.colors_used = MASK_COLORS_COUNT;
+    BMPv3* mapped = create_mapped_BMPv3_file(&mask.header, filename);
+    if (mapped == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < MASK_COLORS_COUNT; i++) {
+        mapped->palette[4 * i] = mapped->palette[4 * i + 1] = mapped->palette[4 * i + 2] = (unsigned char)i;
+        mapped->palette[4 * i + 3] = 0;
+    }
+    return mapped;
+}
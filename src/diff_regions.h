@@ -0,0 +1,47 @@
+#include "bmp_handler.h"
+
+#ifndef HOMEWORK_4_DIFF_REGIONS_H
+#define HOMEWORK_4_DIFF_REGIONS_H
+
+/* Mismatched pixels [x_begin, x_end) of row y. */
+typedef struct {
+    int x_begin;
+    int x_end;
+    long int y;
+} DIFF_RUN;
+
+typedef struct {
+    DIFF_RUN* runs;
+    long int count;
+    long int capacity;
+    int out_of_memory;
+} DIFF_RUNS;
+
+/* Inclusive bounds of a connected region of mismatched pixels. */
+typedef struct {
+    int x_first;
+    long int y_first;
+    int x_last;
+    long int y_last;
+    long int pixels_count;
+} DIFF_BOX;
+
+/* Appends a run; once an allocation fails, out_of_memory is set and later runs are dropped. */
+void add_diff_run(DIFF_RUNS* runs, int x_begin, int x_end, long int y);
+
+/* Appends all runs of source to destination. */
+void append_diff_runs(DIFF_RUNS* destination, const DIFF_RUNS* source);
+
+void free_diff_runs(DIFF_RUNS* runs);
+
+/* Groups runs sorted by row and then by x into 8-connected regions: runs of neighbouring rows
+   that touch, diagonally included, are joined with union-find. Returns the count of boxes stored
+   in the array *boxes points to, in the order of their first run, or -1 if memory runs out. */
+long int find_diff_boxes(const DIFF_RUNS* runs, DIFF_BOX** boxes);
+
+/* Creates an 8 bpp mask image of the given size and row order, mapped from the file so that
+   every mask row set in data goes straight to it. All pixels start at 0 (black); mismatched
+   pixels are to be set to 255 (white) through the grey palette. Release with BMPv3_free. */
+BMPv3* create_diff_mask(char* filename, long int width, long int height);
+
+#endif //HOMEWORK_4_DIFF_REGIONS_H
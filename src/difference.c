@@ -0,0 +1,169 @@
+#include "difference.h"
+#include "kernel_dispatch.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DIFFERENCE_HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+/* The vector kernels sum squares in 32-bit lanes, each of which gains at most 2 * 2 * 255^2
+   per vector; they are widened to 64 bits after this many vectors, well before they overflow. */
+#define BLOCK_VECTORS_COUNT 4096
+
+typedef int (*measure_function)(const unsigned char*, const unsigned char*, size_t, unsigned long long*);
+
+static int measure_differences_portable(const unsigned char* first, const unsigned char* second, size_t size,
+                                        unsigned long long* squared_sum) {
+    unsigned long long sum = 0;
+    int maximum = 0;
+    for (size_t i = 0; i < size; i++) {
+        int difference = first[i] > second[i] ? first[i] - second[i] : second[i] - first[i];
+        sum += (unsigned long long)(difference * difference);
+        if (difference > maximum) {
+            maximum = difference;
+        }
+    }
+    *squared_sum += sum;
+    return maximum;
+}
+
+static int get_largest_byte(const unsigned char* bytes, int count) {
+    int maximum = 0;
+    for (int i = 0; i < count; i++) {
+        if (bytes[i] > maximum) {
+            maximum = bytes[i];
+        }
+    }
+    return maximum;
+}
+
+#ifdef DIFFERENCE_HAVE_X86
+
+/* |a - b| of unsigned bytes is the saturated a - b or'ed with the saturated b - a. Its bytes are
+   then widened against zero, and pmaddwd squares them and adds neighbouring pairs into 32 bits. */
+__attribute__((target("sse2")))
+static int measure_differences_sse2(const unsigned char* first, const unsigned char* second, size_t size,
+                                    unsigned long long* squared_sum) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i maximum = zero;
+    __m128i sum = zero;
+    unsigned char bytes[16];
+    unsigned long long sums[2];
+    size_t i = 0;
+    while (i + 16 <= size) {
+        __m128i partial = zero;
+        for (size_t block_end = i + 16 * BLOCK_VECTORS_COUNT; i + 16 <= size && i < block_end; i += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(first + i));
+            __m128i b = _mm_loadu_si128((const __m128i*)(second + i));
+            __m128i difference = _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+            __m128i low = _mm_unpacklo_epi8(difference, zero);
+            __m128i high = _mm_unpackhi_epi8(difference, zero);
+            maximum = _mm_max_epu8(maximum, difference);
+            partial = _mm_add_epi32(partial, _mm_add_epi32(_mm_madd_epi16(low, low), _mm_madd_epi16(high, high)));
+        }
+        sum = _mm_add_epi64(sum, _mm_unpacklo_epi32(partial, zero));
+        sum = _mm_add_epi64(sum, _mm_unpackhi_epi32(partial, zero));
+    }
+    _mm_storeu_si128((__m128i*)bytes, maximum);
+    _mm_storeu_si128((__m128i*)sums, sum);
+    *squared_sum += sums[0] + sums[1];
+    int tail_maximum = measure_differences_portable(first + i, second + i, size - i, squared_sum);
+    int vector_maximum = get_largest_byte(bytes, 16);
+    return tail_maximum > vector_maximum ? tail_maximum : vector_maximum;
+}
+
+__attribute__((target("avx2")))
+static int measure_differences_avx2(const unsigned char* first, const unsigned char* second, size_t size,
+                                    unsigned long long* squared_sum) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i maximum = zero;
+    __m256i sum = zero;
+    unsigned char bytes[32];
+    unsigned long long sums[4];
+    size_t i = 0;
+    while (i + 32 <= size) {
+        __m256i partial = zero;
+        for (size_t block_end = i + 32 * BLOCK_VECTORS_COUNT; i + 32 <= size && i < block_end; i += 32) {
+            __m256i a = _mm256_loadu_si256((const __m256i*)(first + i));
+            __m256i b = _mm256_loadu_si256((const __m256i*)(second + i));
+            __m256i difference = _mm256_or_si256(_mm256_subs_epu8(a, b), _mm256_subs_epu8(b, a));
+            __m256i low = _mm256_unpacklo_epi8(difference, zero);
+            __m256i high = _mm256_unpackhi_epi8(difference, zero);
+            maximum = _mm256_max_epu8(maximum, difference);
+            partial = _mm256_add_epi32(partial,
+                                       _mm256_add_epi32(_mm256_madd_epi16(low, low), _mm256_madd_epi16(high, high)));
+        }
+        sum = _mm256_add_epi64(sum, _mm256_unpacklo_epi32(partial, zero));
+        sum = _mm256_add_epi64(sum, _mm256_unpackhi_epi32(partial, zero));
+    }
+    _mm256_storeu_si256((__m256i*)bytes, maximum);
+    _mm256_storeu_si256((__m256i*)sums, sum);
+    *squared_sum += sums[0] + sums[1] + sums[2] + sums[3];
+    int tail_maximum = measure_differences_portable(first + i, second + i, size - i, squared_sum);
+    int vector_maximum = get_largest_byte(bytes, 32);
+    return tail_maximum > vector_maximum ? tail_maximum : vector_maximum;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static int measure_differences_avx512(const unsigned char* first, const unsigned char* second, size_t size,
+                                      unsigned long long* squared_sum) {
+    __m512i zero = _mm512_setzero_si512();
+    __m512i maximum = zero;
+    __m512i sum = zero;
+    unsigned char bytes[64];
+    unsigned long long sums[8];
+    size_t i = 0;
+    while (i + 64 <= size) {
+        __m512i partial = zero;
+        for (size_t block_end = i + 64 * BLOCK_VECTORS_COUNT; i + 64 <= size && i < block_end; i += 64) {
+            __m512i a = _mm512_loadu_si512((const void*)(first + i));
+            __m512i b = _mm512_loadu_si512((const void*)(second + i));
+            __m512i difference = _mm512_or_si512(_mm512_subs_epu8(a, b), _mm512_subs_epu8(b, a));
+            __m512i low = _mm512_unpacklo_epi8(difference, zero);
+            __m512i high = _mm512_unpackhi_epi8(difference, zero);
+            maximum = _mm512_max_epu8(maximum, difference);
+            partial = _mm512_add_epi32(partial,
+                                       _mm512_add_epi32(_mm512_madd_epi16(low, low), _mm512_madd_epi16(high, high)));
+        }
+        sum = _mm512_add_epi64(sum, _mm512_unpacklo_epi32(partial, zero));
+        sum = _mm512_add_epi64(sum, _mm512_unpackhi_epi32(partial, zero));
+    }
+    _mm512_storeu_si512((void*)bytes, maximum);
+    _mm512_storeu_si512((void*)sums, sum);
+    for (int k = 0; k < 8; k++) {
+        *squared_sum += sums[k];
+    }
+    int tail_maximum = measure_differences_portable(first + i, second + i, size - i, squared_sum);
+    int vector_maximum = get_largest_byte(bytes, 64);
+    return tail_maximum > vector_maximum ? tail_maximum : vector_maximum;
+}
+
+#endif
+
+static KERNEL_CHOICE choose_measure_kernel() {
+    KERNEL_CHOICE choice = {(kernel_function)measure_differences_portable, "portable"};
+#ifdef DIFFERENCE_HAVE_X86
+    if (__builtin_cpu_supports("avx512bw")) {
+        choice.function = (kernel_function)measure_differences_avx512;
+        choice.name = "avx512bw";
+    } else if (__builtin_cpu_supports("avx2")) {
+        choice.function = (kernel_function)measure_differences_avx2;
+        choice.name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        choice.function = (kernel_function)measure_differences_sse2;
+        choice.name = "sse2";
+    }
+#endif
+    return choice;
+}
+
+static KERNEL_DISPATCH MEASURE_KERNEL = KERNEL_DISPATCH_INITIALIZER(choose_measure_kernel);
+
+int measure_differences(const unsigned char* first, const unsigned char* second, size_t size,
+                        unsigned long long* squared_sum) {
+    return ((measure_function)kernel_dispatch_get(&MEASURE_KERNEL))(first, second, size, squared_sum);
+}
+
+const char* measure_differences_implementation() {
+    return kernel_dispatch_name(&MEASURE_KERNEL);
+}
@@ -0,0 +1,15 @@
+#include <stddef.h>
+
+#ifndef HOMEWORK_4_DIFFERENCE_H
+#define HOMEWORK_4_DIFFERENCE_H
+
+/* Adds the squares of |first[i] - second[i]| over size bytes to *squared_sum and returns the
+   largest of those differences, both in one pass. The kernel (AVX-512 BW, AVX2, SSE2 or a plain
+   loop) is picked on the first call. */
+int measure_differences(const unsigned char* first, const unsigned char* second, size_t size,
+                        unsigned long long* squared_sum);
+
+/* Name of the kernel measure_differences dispatches to, e.g. "avx2". */
+const char* measure_differences_implementation();
+
+#endif //HOMEWORK_4_DIFFERENCE_H
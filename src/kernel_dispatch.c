@@ -0,0 +1,24 @@
+#include "kernel_dispatch.h"
+#include <stddef.h>
+
+/* Threads may race to choose the kernel; they all store the same values. The name is stored
+   before the function is released, so whoever sees the function also sees the name. */
+static kernel_function choose_kernel(KERNEL_DISPATCH* dispatch) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+#endif
+    KERNEL_CHOICE choice = dispatch->choose();
+    __atomic_store_n(&dispatch->name, choice.name, __ATOMIC_RELAXED);
+    __atomic_store_n(&dispatch->function, choice.function, __ATOMIC_RELEASE);
+    return choice.function;
+}
+
+kernel_function kernel_dispatch_get(KERNEL_DISPATCH* dispatch) {
+    kernel_function function = __atomic_load_n(&dispatch->function, __ATOMIC_ACQUIRE);
+    return function != NULL ? function : choose_kernel(dispatch);
+}
+
+const char* kernel_dispatch_name(KERNEL_DISPATCH* dispatch) {
+    kernel_dispatch_get(dispatch);
+    return __atomic_load_n(&dispatch->name, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,29 @@
+#ifndef HOMEWORK_4_KERNEL_DISPATCH_H
+#define HOMEWORK_4_KERNEL_DISPATCH_H
+
+/* Kernels of every signature are stored as this type and cast back by the module that owns them. */
+typedef void (*kernel_function)(void);
+
+typedef struct {
+    kernel_function function;
+    /* Reported by the module's *_implementation function, e.g. "avx2". */
+    const char* name;
+} KERNEL_CHOICE;
+
+/* A kernel picked for the running CPU on first use. choose tests the CPU features, widest first,
+   and falls back to the portable kernel; the cache is filled by kernel_dispatch_get. */
+typedef struct {
+    KERNEL_CHOICE (*choose)(void);
+    kernel_function function;
+    const char* name;
+} KERNEL_DISPATCH;
+
+#define KERNEL_DISPATCH_INITIALIZER(choose) {(choose), NULL, NULL}
+
+/* The cached kernel, chosen on the first call. */
+kernel_function kernel_dispatch_get(KERNEL_DISPATCH* dispatch);
+
+/* Name of the cached kernel, chosen on the first call. */
+const char* kernel_dispatch_name(KERNEL_DISPATCH* dispatch);
+
+#endif //HOMEWORK_4_KERNEL_DISPATCH_H
@@ -0,0 +1,115 @@
+#include "lut.h"
+#include "kernel_dispatch.h"
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LUT_HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+static void lookup_pixels_portable(unsigned char* destination, const unsigned char* source, size_t size,
+                                   const unsigned char tables[LUT_CHANNELS_COUNT][256]) {
+    size_t i = 0;
+    for (; i + LUT_CHANNELS_COUNT <= size; i += LUT_CHANNELS_COUNT) {
+        destination[i] = tables[0][source[i]];
+        destination[i + 1] = tables[1][source[i + 1]];
+        destination[i + 2] = tables[2][source[i + 2]];
+    }
+    for (; i < size; i++) {
+        destination[i] = tables[i % LUT_CHANNELS_COUNT][source[i]];
+    }
+}
+
+static int are_tables_equal(const unsigned char tables[LUT_CHANNELS_COUNT][256]) {
+    return memcmp(tables[0], tables[1], 256) == 0 && memcmp(tables[0], tables[2], 256) == 0;
+}
+
+#ifdef LUT_HAVE_X86
+
+/* vpermi2b looks up 128 entries held in two registers; the top bit of the byte picks
+   between the lower and the upper half of the table. */
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+static __m512i lookup_avx512(__m512i x, const __m512i quarters[4]) {
+    __m512i low = _mm512_permutex2var_epi8(quarters[0], x, quarters[1]);
+    __m512i high = _mm512_permutex2var_epi8(quarters[2], x, quarters[3]);
+    return _mm512_mask_blend_epi8(_mm512_movepi8_mask(x), low, high);
+}
+
+/* The AVX-512 kernel looks a byte up in every distinct table and then picks, for each byte
+   position, the result of its channel. A vector of 64 bytes starting at byte offset i has its
+   first byte in channel i % 3, so there is one set of pick masks for each of the three phases.
+   A 16-row pshufb lookup for AVX2 and SSSE3 was slower than the portable loop, so there is none. */
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+static void lookup_pixels_avx512(unsigned char* destination, const unsigned char* source, size_t size,
+                                 const unsigned char tables[LUT_CHANNELS_COUNT][256]) {
+    __mmask64 channel_masks[LUT_CHANNELS_COUNT][LUT_CHANNELS_COUNT];
+    __m512i quarters[LUT_CHANNELS_COUNT][4];
+    int channels_count = are_tables_equal(tables) ? 1 : LUT_CHANNELS_COUNT;
+    size_t i = 0;
+    for (int phase = 0; phase < LUT_CHANNELS_COUNT; phase++) {
+        for (int c = 0; c < LUT_CHANNELS_COUNT; c++) {
+            channel_masks[phase][c] = 0;
+            for (int j = 0; j < 64; j++) {
+                if ((phase + j) % LUT_CHANNELS_COUNT == c) {
+                    channel_masks[phase][c] |= (__mmask64)1 << j;
+                }
+            }
+        }
+    }
+    for (int c = 0; c < channels_count; c++) {
+        for (int k = 0; k < 4; k++) {
+            quarters[c][k] = _mm512_loadu_si512((const void*)(tables[c] + 64 * k));
+        }
+    }
+    for (; i + 64 <= size; i += 64) {
+        __m512i x = _mm512_loadu_si512((const void*)(source + i));
+        __m512i result = lookup_avx512(x, quarters[0]);
+        if (channels_count > 1) {
+            int phase = (int)(i % LUT_CHANNELS_COUNT);
+            result = _mm512_mask_blend_epi8(channel_masks[phase][1], result, lookup_avx512(x, quarters[1]));
+            result = _mm512_mask_blend_epi8(channel_masks[phase][2], result, lookup_avx512(x, quarters[2]));
+        }
+        _mm512_storeu_si512((void*)(destination + i), result);
+    }
+    for (; i < size; i++) {
+        destination[i] = tables[i % LUT_CHANNELS_COUNT][source[i]];
+    }
+}
+
+#endif
+
+static KERNEL_CHOICE choose_lookup_kernel() {
+    KERNEL_CHOICE choice = {(kernel_function)lookup_pixels_portable, "portable"};
+#ifdef LUT_HAVE_X86
+    if (__builtin_cpu_supports("avx512vbmi") && __builtin_cpu_supports("avx512bw")) {
+        choice.function = (kernel_function)lookup_pixels_avx512;
+        choice.name = "avx512vbmi";
+    }
+#endif
+    return choice;
+}
+
+static KERNEL_DISPATCH LOOKUP_KERNEL = KERNEL_DISPATCH_INITIALIZER(choose_lookup_kernel);
+
+void lookup_pixels(unsigned char* destination, const unsigned char* source, size_t size,
+                   const unsigned char tables[LUT_CHANNELS_COUNT][256]) {
+    ((lookup_pixels_function)kernel_dispatch_get(&LOOKUP_KERNEL))(destination, source, size, tables);
+}
+
+const char* lookup_pixels_implementation() {
+    return kernel_dispatch_name(&LOOKUP_KERNEL);
+}
+
+int get_lookup_pixels_kernels(LUT_KERNEL kernels[LUT_KERNELS_MAX_COUNT]) {
+    int count = 0;
+#ifdef LUT_HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512vbmi") && __builtin_cpu_supports("avx512bw")) {
+        kernels[count].lookup = lookup_pixels_avx512;
+        kernels[count++].name = "avx512vbmi";
+    }
+#endif
+    kernels[count].lookup = lookup_pixels_portable;
+    kernels[count++].name = "portable";
+    return count;
+}
@@ -0,0 +1,32 @@
+#include <stddef.h>
+
+#ifndef HOMEWORK_4_LUT_H
+#define HOMEWORK_4_LUT_H
+
+#define LUT_CHANNELS_COUNT 3
+
+/* Maps size bytes of packed 3-byte pixels through per-channel tables: byte i becomes
+   tables[i % 3][source[i]], so size is expected to be a multiple of 3 for whole pixels.
+   The buffers may be the same but must not partially overlap. The kernel (AVX-512 VBMI
+   vpermi2b or a plain loop) is picked on the first call. */
+void lookup_pixels(unsigned char* destination, const unsigned char* source, size_t size,
+                   const unsigned char tables[LUT_CHANNELS_COUNT][256]);
+
+/* Name of the kernel lookup_pixels dispatches to, e.g. "avx512vbmi". */
+const char* lookup_pixels_implementation();
+
+typedef void (*lookup_pixels_function)(unsigned char* destination, const unsigned char* source, size_t size,
+                                       const unsigned char tables[LUT_CHANNELS_COUNT][256]);
+
+typedef struct {
+    lookup_pixels_function lookup;
+    const char* name;
+} LUT_KERNEL;
+
+#define LUT_KERNELS_MAX_COUNT 2
+
+/* Stores every kernel the running CPU can run, the portable loop last, so that
+   benchmarks can time them and check them against each other. Returns how many were stored. */
+int get_lookup_pixels_kernels(LUT_KERNEL kernels[LUT_KERNELS_MAX_COUNT]);
+
+#endif //HOMEWORK_4_LUT_H
@@ -0,0 +1,128 @@
+#include "mismatch_report.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define error(...) (fprintf(stderr, __VA_ARGS__))
+#define REPORT_BUFFER_SIZE (1024 * 1024)
+#define REPORT_MAGIC "BMPDIFF1"
+#define REPORT_MAGIC_SIZE 8
+/* Longest text line: two 20-digit numbers, a space and a newline. */
+#define MAX_RECORD_SIZE 42
+
+struct mismatch_report {
+    int fd;
+    int owns_fd;
+    MISMATCH_REPORT_FORMAT format;
+    char* buffer;
+    size_t size;
+    int failed;
+};
+
+static const char DIGIT_PAIRS[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/* Writes the decimal digits of value so that they end right before end; returns where they start.
+   Two digits are taken from the table per division. */
+static char* format_unsigned(char* end, unsigned long int value) {
+    while (value >= 100) {
+        unsigned long int pair = value % 100;
+        value /= 100;
+        end -= 2;
+        memcpy(end, DIGIT_PAIRS + 2 * pair, 2);
+    }
+    if (value >= 10) {
+        end -= 2;
+        memcpy(end, DIGIT_PAIRS + 2 * value, 2);
+    } else {
+        *--end = (char)('0' + value);
+    }
+    return end;
+}
+
+static void put_bytes(unsigned long int x, int size, char* bytes) {
+    for (int i = 0; i < size; i++) {
+        bytes[i] = (char)(x >> (8 * i));
+    }
+}
+
+static void flush_report(Mismatch_Report* report) {
+    size_t written = 0;
+    while (written < report->size && !report->failed) {
+        ssize_t count = write(report->fd, report->buffer + written, report->size - written);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            report->failed = 1;
+        } else {
+            written += count;
+        }
+    }
+    report->size = 0;
+}
+
+Mismatch_Report* mismatch_report_open(char* filename, MISMATCH_REPORT_FORMAT format) {
+    Mismatch_Report* report = (Mismatch_Report*)calloc(1, sizeof(Mismatch_Report));
+    if (report == NULL || (report->buffer = (char*)malloc(REPORT_BUFFER_SIZE)) == NULL) {
+        error("%s\n", "Could not allocate memory for the mismatch report");
+        free(report);
+        return NULL;
+    }
+    report->format = format;
+    report->fd = STDERR_FILENO;
+    if (filename != NULL) {
+        report->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        report->owns_fd = 1;
+        if (report->fd < 0) {
+            error("Could not create %s\n", filename);
+            free(report->buffer);
+            free(report);
+            return NULL;
+        }
+    }
+    if (format == MISMATCH_REPORT_BINARY) {
+        memcpy(report->buffer, REPORT_MAGIC, REPORT_MAGIC_SIZE);
+        report->size = REPORT_MAGIC_SIZE;
+    }
+    return report;
+}
+
+void mismatch_report_add(Mismatch_Report* report, int x, long int y) {
+    if (report->size + MAX_RECORD_SIZE > REPORT_BUFFER_SIZE) {
+        flush_report(report);
+    }
+    if (report->format == MISMATCH_REPORT_BINARY) {
+        put_bytes((unsigned long int)x, 4, report->buffer + report->size);
+        put_bytes((unsigned long int)y, 4, report->buffer + report->size + 4);
+        report->size += 8;
+        return;
+    }
+    char line[MAX_RECORD_SIZE];
+    char* end = line + MAX_RECORD_SIZE;
+    *--end = '\n';
+    char* start = format_unsigned(end, (unsigned long int)y);
+    *--start = ' ';
+    start = format_unsigned(start, (unsigned long int)x);
+    memcpy(report->buffer + report->size, start, line + MAX_RECORD_SIZE - start);
+    report->size += line + MAX_RECORD_SIZE - start;
+}
+
+int mismatch_report_close(Mismatch_Report* report) {
+    flush_report(report);
+    int failed = report->failed;
+    if (report->owns_fd && close(report->fd) != 0) {
+        failed = 1;
+    }
+    if (failed) {
+        error("%s\n", "Could not write the mismatch report");
+    }
+    free(report->buffer);
+    free(report);
+    return failed;
+}
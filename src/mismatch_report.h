@@ -0,0 +1,25 @@
+#ifndef HOMEWORK_4_MISMATCH_REPORT_H
+#define HOMEWORK_4_MISMATCH_REPORT_H
+
+typedef enum {
+    /* "x y\n" lines. */
+    MISMATCH_REPORT_TEXT = 0,
+    /* The magic "BMPDIFF1", then x and y of every mismatch as little-endian 4-byte integers. */
+    MISMATCH_REPORT_BINARY
+} MISMATCH_REPORT_FORMAT;
+
+/* Collects mismatch coordinates in a large buffer that is written out with one write call
+   whenever it fills up, instead of one formatted print per mismatch. */
+typedef struct mismatch_report Mismatch_Report;
+
+/* Writes to the file, created or truncated, or to stderr when filename is NULL.
+   Returns NULL (and prints the problem) on failure. */
+Mismatch_Report* mismatch_report_open(char* filename, MISMATCH_REPORT_FORMAT format);
+
+void mismatch_report_add(Mismatch_Report* report, int x, long int y);
+
+/* Writes out what is buffered and releases the report. Returns 0 on success; otherwise
+   prints the problem to stderr and returns 1. */
+int mismatch_report_close(Mismatch_Report* report);
+
+#endif //HOMEWORK_4_MISMATCH_REPORT_H
@@ -0,0 +1,136 @@
+#include "negation.h"
+#include "kernel_dispatch.h"
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define NEGATION_HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+/* Every kernel XORs the data with a 4-byte pattern repeated from the first byte on:
+   all ones negates every byte, 0x00FFFFFF negates BGRA pixels but keeps their alpha. */
+#define NEGATE_ALL_PATTERN 0xFFFFFFFFu
+#define NEGATE_BGR_PATTERN 0x00FFFFFFu
+
+typedef void (*negate_function)(unsigned char*, const unsigned char*, size_t, uint32_t);
+
+static void negate_bytes_portable(unsigned char* destination, const unsigned char* source, size_t size,
+                                  uint32_t pattern) {
+    size_t i = 0;
+    uint64_t word;
+    uint64_t wide_pattern = (uint64_t)pattern << 32 | pattern;
+    for (; i + sizeof(word) <= size; i += sizeof(word)) {
+        memcpy(&word, source + i, sizeof(word));
+        word ^= wide_pattern;
+        memcpy(destination + i, &word, sizeof(word));
+    }
+    for (; i < size; i++) {
+        destination[i] = source[i] ^ (unsigned char)(pattern >> (8 * (i % 4)));
+    }
+}
+
+#ifdef NEGATION_HAVE_X86
+
+__attribute__((target("sse2")))
+static void negate_bytes_sse2(unsigned char* destination, const unsigned char* source, size_t size,
+                              uint32_t pattern) {
+    const __m128i ones = _mm_set1_epi32((int)pattern);
+    size_t i = 0;
+    for (; i + 64 <= size; i += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(source + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(source + i + 16));
+        __m128i c = _mm_loadu_si128((const __m128i*)(source + i + 32));
+        __m128i d = _mm_loadu_si128((const __m128i*)(source + i + 48));
+        _mm_storeu_si128((__m128i*)(destination + i), _mm_xor_si128(a, ones));
+        _mm_storeu_si128((__m128i*)(destination + i + 16), _mm_xor_si128(b, ones));
+        _mm_storeu_si128((__m128i*)(destination + i + 32), _mm_xor_si128(c, ones));
+        _mm_storeu_si128((__m128i*)(destination + i + 48), _mm_xor_si128(d, ones));
+    }
+    for (; i + 16 <= size; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(source + i));
+        _mm_storeu_si128((__m128i*)(destination + i), _mm_xor_si128(a, ones));
+    }
+    negate_bytes_portable(destination + i, source + i, size - i, pattern);
+}
+
+__attribute__((target("avx2")))
+static void negate_bytes_avx2(unsigned char* destination, const unsigned char* source, size_t size,
+                              uint32_t pattern) {
+    const __m256i ones = _mm256_set1_epi32((int)pattern);
+    size_t i = 0;
+    for (; i + 128 <= size; i += 128) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(source + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(source + i + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i*)(source + i + 64));
+        __m256i d = _mm256_loadu_si256((const __m256i*)(source + i + 96));
+        _mm256_storeu_si256((__m256i*)(destination + i), _mm256_xor_si256(a, ones));
+        _mm256_storeu_si256((__m256i*)(destination + i + 32), _mm256_xor_si256(b, ones));
+        _mm256_storeu_si256((__m256i*)(destination + i + 64), _mm256_xor_si256(c, ones));
+        _mm256_storeu_si256((__m256i*)(destination + i + 96), _mm256_xor_si256(d, ones));
+    }
+    for (; i + 32 <= size; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(source + i));
+        _mm256_storeu_si256((__m256i*)(destination + i), _mm256_xor_si256(a, ones));
+    }
+    negate_bytes_portable(destination + i, source + i, size - i, pattern);
+}
+
+__attribute__((target("avx512f")))
+static void negate_bytes_avx512(unsigned char* destination, const unsigned char* source, size_t size,
+                                uint32_t pattern) {
+    const __m512i ones = _mm512_set1_epi32((int)pattern);
+    size_t i = 0;
+    for (; i + 256 <= size; i += 256) {
+        __m512i a = _mm512_loadu_si512((const void*)(source + i));
+        __m512i b = _mm512_loadu_si512((const void*)(source + i + 64));
+        __m512i c = _mm512_loadu_si512((const void*)(source + i + 128));
+        __m512i d = _mm512_loadu_si512((const void*)(source + i + 192));
+        _mm512_storeu_si512((void*)(destination + i), _mm512_xor_si512(a, ones));
+        _mm512_storeu_si512((void*)(destination + i + 64), _mm512_xor_si512(b, ones));
+        _mm512_storeu_si512((void*)(destination + i + 128), _mm512_xor_si512(c, ones));
+        _mm512_storeu_si512((void*)(destination + i + 192), _mm512_xor_si512(d, ones));
+    }
+    for (; i + 64 <= size; i += 64) {
+        __m512i a = _mm512_loadu_si512((const void*)(source + i));
+        _mm512_storeu_si512((void*)(destination + i), _mm512_xor_si512(a, ones));
+    }
+    negate_bytes_portable(destination + i, source + i, size - i, pattern);
+}
+
+#endif
+
+static KERNEL_CHOICE choose_negate_kernel() {
+    KERNEL_CHOICE choice = {(kernel_function)negate_bytes_portable, "portable"};
+#ifdef NEGATION_HAVE_X86
+    if (__builtin_cpu_supports("avx512f")) {
+        choice.function = (kernel_function)negate_bytes_avx512;
+        choice.name = "avx512";
+    } else if (__builtin_cpu_supports("avx2")) {
+        choice.function = (kernel_function)negate_bytes_avx2;
+        choice.name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        choice.function = (kernel_function)negate_bytes_sse2;
+        choice.name = "sse2";
+    }
+#endif
+    return choice;
+}
+
+static KERNEL_DISPATCH NEGATE_KERNEL = KERNEL_DISPATCH_INITIALIZER(choose_negate_kernel);
+
+static negate_function get_negate_kernel() {
+    return (negate_function)kernel_dispatch_get(&NEGATE_KERNEL);
+}
+
+void negate_bytes(unsigned char* destination, const unsigned char* source, size_t size) {
+    get_negate_kernel()(destination, source, size, NEGATE_ALL_PATTERN);
+}
+
+void negate_bgra_pixels(unsigned char* destination, const unsigned char* source, size_t size) {
+    get_negate_kernel()(destination, source, size, NEGATE_BGR_PATTERN);
+}
+
+const char* negate_bytes_implementation() {
+    return kernel_dispatch_name(&NEGATE_KERNEL);
+}
@@ -0,0 +1,19 @@
+#include <stddef.h>
+
+#ifndef HOMEWORK_4_NEGATION_H
+#define HOMEWORK_4_NEGATION_H
+
+/* Writes ~source[i] to destination[i] for every byte. The buffers may be the same
+   (in-place negation) but must not partially overlap. The widest kernel supported by
+   the running CPU (AVX-512, AVX2, SSE2 or 64-bit words) is picked on the first call. */
+void negate_bytes(unsigned char* destination, const unsigned char* source, size_t size);
+
+/* Negates the blue, green and red bytes of packed 4-byte BGRA pixels and keeps alpha as it is;
+   size is in bytes and the first byte must start a pixel. Runs on the same kernels as negate_bytes,
+   which XOR with a mask that has zeros in the alpha lanes. */
+void negate_bgra_pixels(unsigned char* destination, const unsigned char* source, size_t size);
+
+/* Name of the kernel negate_bytes dispatches to, e.g. "avx2". */
+const char* negate_bytes_implementation();
+
+#endif //HOMEWORK_4_NEGATION_H
@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "negation.h"
+
+#define DEFAULT_BUFFER_SIZE_MB 256
+#define REPETITIONS 10
+#define error(...) (fprintf(stderr, __VA_ARGS__))
+
+/* The loop converter --mine used before negate_bytes existed. */
+static void negate_bytes_loop(unsigned char* data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        data[i] = ~data[i];
+    }
+}
+
+static double seconds_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+int main(int argc, char* argv[]) {
+    size_t size_mb = DEFAULT_BUFFER_SIZE_MB;
+    if (argc > 2 || (argc == 2 && (size_mb = strtoul(argv[1], NULL, 10)) == 0)) {
+        error("%s", "Usage: negation_bench [buffer size in MB]\n");
+        return -1;
+    }
+    size_t size = size_mb << 20;
+    unsigned char* data = (unsigned char*)malloc(size);
+    if (data == NULL) {
+        error("%s", "Could not allocate the benchmark buffer\n");
+        return -1;
+    }
+    for (size_t i = 0; i < size; i++) {
+        data[i] = (unsigned char)(i * 131);
+    }
+    negate_bytes_loop(data, size);
+    negate_bytes(data, data, size);
+    double best_loop = 0, best_kernel = 0;
+    for (int r = 0; r < REPETITIONS; r++) {
+        double start = seconds_now();
+        negate_bytes_loop(data, size);
+        double loop = seconds_now() - start;
+        start = seconds_now();
+        negate_bytes(data, data, size);
+        double kernel = seconds_now() - start;
+        if (r == 0 || loop < best_loop) best_loop = loop;
+        if (r == 0 || kernel < best_kernel) best_kernel = kernel;
+    }
+    double gigabytes = size / 1e9;
+    printf("buffer: %zu MB\n", size_mb);
+    printf("byte loop: %.2f GB/s\n", gigabytes / best_loop);
+    printf("negate_bytes (%s): %.2f GB/s\n", negate_bytes_implementation(), gigabytes / best_kernel);
+    free(data);
+    return 0;
+}
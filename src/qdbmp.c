@@ -59,16 +59,22 @@ static const char* BMP_ERROR_STRING[] =
 /* Size of the palette data for 4 BPP bitmaps */
 #define BMP_PALETTE_SIZE_4bpp ( 16 * 4 )
 
+/* Size of the file header and the bitmap info header as stored on disk */
+#define BMP_HEADER_SIZE 54
+
 
 /*********************************** Forward declarations **********************************/
 int		ReadHeader	( BMP* bmp, FILE* f );
 int		WriteHeader	( BMP* bmp, FILE* f );
 
-int		ReadUINT	( UINT* x, FILE* f );
-int		ReadUSHORT	( USHORT *x, FILE* f );
+void	DecodeHeader	( BMP* bmp, const UCHAR* header );
+void	EncodeHeader	( BMP* bmp, UCHAR* header );
+
+UINT	DecodeUINT		( const UCHAR* little );
+USHORT	DecodeUSHORT	( const UCHAR* little );
 
-int		WriteUINT	( UINT x, FILE* f );
-int		WriteUSHORT	( USHORT x, FILE* f );
+void	EncodeUINT		( UINT x, UCHAR* little );
+void	EncodeUSHORT	( USHORT x, UCHAR* little );
 
 
 
@@ -381,6 +387,61 @@ void BMP_WriteFile( BMP* bmp, const char* filename )
 }
 
 
+/**************************************************************
+	Reads only the header of the specified BMP image file and
+	returns its dimensions and color depth. No memory is
+	allocated and the pixel data is never read.
+**************************************************************/
+void BMP_ProbeFile( const char* filename, UINT* width, UINT* height, USHORT* depth )
+{
+	BMP		bmp;
+	FILE*	f;
+
+	if ( filename == NULL )
+	{
+		BMP_LAST_ERROR_CODE = BMP_INVALID_ARGUMENT;
+		return;
+	}
+
+
+	/* Open file; it is unbuffered since only the header is needed */
+	f = fopen( filename, "rb" );
+	if ( f == NULL )
+	{
+		BMP_LAST_ERROR_CODE = BMP_FILE_NOT_FOUND;
+		return;
+	}
+	setvbuf( f, NULL, _IONBF, 0 );
+
+
+	/* Read header */
+	if ( ReadHeader( &bmp, f ) != BMP_OK || bmp.Header.Magic != 0x4D42 )
+	{
+		BMP_LAST_ERROR_CODE = BMP_FILE_INVALID;
+		fclose( f );
+		return;
+	}
+
+	fclose( f );
+
+
+	/* Verify that the bitmap variant is supported */
+	if ( ( bmp.Header.BitsPerPixel != 32 && bmp.Header.BitsPerPixel != 24
+		&& bmp.Header.BitsPerPixel != 8 && bmp.Header.BitsPerPixel != 4 )
+		|| bmp.Header.CompressionType != 0 || bmp.Header.HeaderSize != 40 )
+	{
+		BMP_LAST_ERROR_CODE = BMP_FILE_NOT_SUPPORTED;
+		return;
+	}
+
+	if ( width )	*width = bmp.Header.Width;
+	if ( height )	*height = bmp.Header.Height;
+	if ( depth )	*depth = bmp.Header.BitsPerPixel;
+
+	BMP_LAST_ERROR_CODE = BMP_OK;
+}
+
+
 /**************************************************************
 	Returns the image's width.
 **************************************************************/
@@ -617,6 +678,73 @@ void BMP_SetPixelIndex( BMP* bmp, UINT x, UINT y, UCHAR val )
 }
 
 
+/**************************************************************
+	Returns a pointer to the first pixel of row y (counted from
+	the top, like the pixel access methods) and stores the row's
+	size in bytes, padding included, in bytes_per_row.
+	Unlike the per-pixel methods the error code is only touched
+	on failure, so rows may be fetched from several threads.
+**************************************************************/
+UCHAR* BMP_GetRow( BMP* bmp, UINT y, UINT* bytes_per_row )
+{
+	UINT	row_size;
+
+	if ( bmp == NULL || y >= bmp->Header.Height )
+	{
+		BMP_LAST_ERROR_CODE = BMP_INVALID_ARGUMENT;
+		return NULL;
+	}
+
+	/* Row's size is rounded up to the next multiple of 4 bytes */
+	row_size = bmp->Header.ImageDataSize / bmp->Header.Height;
+
+	if ( bytes_per_row )	*bytes_per_row = row_size;
+
+	/* Rows are flipped */
+	return bmp->Data + ( bmp->Header.Height - y - 1 ) * row_size;
+}
+
+
+/**************************************************************
+	Calls transform on the rows y .. y + count - 1, in the order
+	they are stored in memory. Each row is passed as a pointer
+	to its first pixel together with the image's width and
+	depth. The arguments are checked once for the whole range,
+	and the error code is only touched on failure.
+**************************************************************/
+void BMP_TransformRows( BMP* bmp, UINT y, UINT count,
+						void ( *transform )( UCHAR* row, UINT width, USHORT depth, void* context ),
+						void* context )
+{
+	UCHAR*	row;
+	UINT	bytes_per_row = 0;
+	UINT	i;
+
+	if ( bmp == NULL || transform == NULL || y >= bmp->Header.Height || count > bmp->Header.Height - y )
+	{
+		BMP_LAST_ERROR_CODE = BMP_INVALID_ARGUMENT;
+		return;
+	}
+
+	if ( count == 0 )
+	{
+		return;
+	}
+
+	/* The last requested row is the lowest in memory since rows are flipped */
+	row = BMP_GetRow( bmp, y + count - 1, &bytes_per_row );
+	if ( row == NULL )
+	{
+		return;
+	}
+
+	for ( i = 0 ; i < count ; ++i, row += bytes_per_row )
+	{
+		transform( row, bmp->Header.Width, bmp->Header.BitsPerPixel, context );
+	}
+}
+
+
 /**************************************************************
 	Gets the color value for the specified palette index.
 **************************************************************/
@@ -708,29 +836,20 @@ const char* BMP_GetErrorDescription()
 **************************************************************/
 int	ReadHeader( BMP* bmp, FILE* f )
 {
+	UCHAR	header[ BMP_HEADER_SIZE ];
+
 	if ( bmp == NULL || f == NULL )
 	{
 		return BMP_INVALID_ARGUMENT;
 	}
 
-	/* The header's fields are read one by one, and converted from the format's
-	little endian to the system's native representation. */
-	if ( !ReadUSHORT( &( bmp->Header.Magic ), f ) )			return BMP_IO_ERROR;
-	if ( !ReadUINT( &( bmp->Header.FileSize ), f ) )		return BMP_IO_ERROR;
-	if ( !ReadUSHORT( &( bmp->Header.Reserved1 ), f ) )		return BMP_IO_ERROR;
-	if ( !ReadUSHORT( &( bmp->Header.Reserved2 ), f ) )		return BMP_IO_ERROR;
-	if ( !ReadUINT( &( bmp->Header.DataOffset ), f ) )		return BMP_IO_ERROR;
-	if ( !ReadUINT( &( bmp->Header.HeaderSize ), f ) )		return BMP_IO_ERROR;
-	if ( !ReadUINT( &( bmp->Header.Width ), f ) )			return BMP_IO_ERROR;
-	if ( !ReadUINT( &( bmp->Header.Height ), f ) )			return BMP_IO_ERROR;
-	if ( !ReadUSHORT( &( bmp->Header.Planes ), f ) )		return BMP_IO_ERROR;
-	if ( !ReadUSHORT( &( bmp->Header.BitsPerPixel ), f ) )	return BMP_IO_ERROR;
-	if ( !ReadUINT( &( bmp->Header.CompressionType ), f ) )	return BMP_IO_ERROR;
-	if ( !ReadUINT( &( bmp->Header.ImageDataSize ), f ) )	return BMP_IO_ERROR;
-	if ( !ReadUINT( &( bmp->Header.HPixelsPerMeter ), f ) )	return BMP_IO_ERROR;
-	if ( !ReadUINT( &( bmp->Header.VPixelsPerMeter ), f ) )	return BMP_IO_ERROR;
-	if ( !ReadUINT( &( bmp->Header.ColorsUsed ), f ) )		return BMP_IO_ERROR;
-	if ( !ReadUINT( &( bmp->Header.ColorsRequired ), f ) )	return BMP_IO_ERROR;
+	/* The whole header is read at once and decoded from memory */
+	if ( fread( header, BMP_HEADER_SIZE, 1, f ) != 1 )
+	{
+		return BMP_IO_ERROR;
+	}
+
+	DecodeHeader( bmp, header );
 
 	return BMP_OK;
 }
@@ -742,110 +861,111 @@ int	ReadHeader( BMP* bmp, FILE* f )
 **************************************************************/
 int	WriteHeader( BMP* bmp, FILE* f )
 {
+	UCHAR	header[ BMP_HEADER_SIZE ];
+
 	if ( bmp == NULL || f == NULL )
 	{
 		return BMP_INVALID_ARGUMENT;
 	}
 
-	/* The header's fields are written one by one, and converted to the format's
-	little endian representation. */
-	if ( !WriteUSHORT( bmp->Header.Magic, f ) )			return BMP_IO_ERROR;
-	if ( !WriteUINT( bmp->Header.FileSize, f ) )		return BMP_IO_ERROR;
-	if ( !WriteUSHORT( bmp->Header.Reserved1, f ) )		return BMP_IO_ERROR;
-	if ( !WriteUSHORT( bmp->Header.Reserved2, f ) )		return BMP_IO_ERROR;
-	if ( !WriteUINT( bmp->Header.DataOffset, f ) )		return BMP_IO_ERROR;
-	if ( !WriteUINT( bmp->Header.HeaderSize, f ) )		return BMP_IO_ERROR;
-	if ( !WriteUINT( bmp->Header.Width, f ) )			return BMP_IO_ERROR;
-	if ( !WriteUINT( bmp->Header.Height, f ) )			return BMP_IO_ERROR;
-	if ( !WriteUSHORT( bmp->Header.Planes, f ) )		return BMP_IO_ERROR;
-	if ( !WriteUSHORT( bmp->Header.BitsPerPixel, f ) )	return BMP_IO_ERROR;
-	if ( !WriteUINT( bmp->Header.CompressionType, f ) )	return BMP_IO_ERROR;
-	if ( !WriteUINT( bmp->Header.ImageDataSize, f ) )	return BMP_IO_ERROR;
-	if ( !WriteUINT( bmp->Header.HPixelsPerMeter, f ) )	return BMP_IO_ERROR;
-	if ( !WriteUINT( bmp->Header.VPixelsPerMeter, f ) )	return BMP_IO_ERROR;
-	if ( !WriteUINT( bmp->Header.ColorsUsed, f ) )		return BMP_IO_ERROR;
-	if ( !WriteUINT( bmp->Header.ColorsRequired, f ) )	return BMP_IO_ERROR;
+	/* The whole header is encoded in memory and written at once */
+	EncodeHeader( bmp, header );
+
+	if ( fwrite( header, BMP_HEADER_SIZE, 1, f ) != 1 )
+	{
+		return BMP_IO_ERROR;
+	}
 
 	return BMP_OK;
 }
 
 
 /**************************************************************
-	Reads a little-endian unsigned int from the file.
-	Returns non-zero on success.
+	Decodes the header's fields from the format's little endian
+	to the system's native representation.
 **************************************************************/
-int	ReadUINT( UINT* x, FILE* f )
+void DecodeHeader( BMP* bmp, const UCHAR* header )
 {
-	UCHAR little[ 4 ];	/* BMPs use 32 bit ints */
-
-	if ( x == NULL || f == NULL )
-	{
-		return 0;
-	}
-
-	if ( fread( little, 4, 1, f ) != 1 )
-	{
-		return 0;
-	}
-
-	*x = ( little[ 3 ] << 24 | little[ 2 ] << 16 | little[ 1 ] << 8 | little[ 0 ] );
-
-	return 1;
+	bmp->Header.Magic				= DecodeUSHORT( header + 0 );
+	bmp->Header.FileSize			= DecodeUINT( header + 2 );
+	bmp->Header.Reserved1			= DecodeUSHORT( header + 6 );
+	bmp->Header.Reserved2			= DecodeUSHORT( header + 8 );
+	bmp->Header.DataOffset			= DecodeUINT( header + 10 );
+	bmp->Header.HeaderSize			= DecodeUINT( header + 14 );
+	bmp->Header.Width				= DecodeUINT( header + 18 );
+	bmp->Header.Height				= DecodeUINT( header + 22 );
+	bmp->Header.Planes				= DecodeUSHORT( header + 26 );
+	bmp->Header.BitsPerPixel		= DecodeUSHORT( header + 28 );
+	bmp->Header.CompressionType		= DecodeUINT( header + 30 );
+	bmp->Header.ImageDataSize		= DecodeUINT( header + 34 );
+	bmp->Header.HPixelsPerMeter		= DecodeUINT( header + 38 );
+	bmp->Header.VPixelsPerMeter		= DecodeUINT( header + 42 );
+	bmp->Header.ColorsUsed			= DecodeUINT( header + 46 );
+	bmp->Header.ColorsRequired		= DecodeUINT( header + 50 );
 }
 
 
 /**************************************************************
-	Reads a little-endian unsigned short int from the file.
-	Returns non-zero on success.
+	Encodes the header's fields to the format's little endian
+	representation.
 **************************************************************/
-int	ReadUSHORT( USHORT *x, FILE* f )
+void EncodeHeader( BMP* bmp, UCHAR* header )
 {
-	UCHAR little[ 2 ];	/* BMPs use 16 bit shorts */
+	EncodeUSHORT( bmp->Header.Magic, header + 0 );
+	EncodeUINT( bmp->Header.FileSize, header + 2 );
+	EncodeUSHORT( bmp->Header.Reserved1, header + 6 );
+	EncodeUSHORT( bmp->Header.Reserved2, header + 8 );
+	EncodeUINT( bmp->Header.DataOffset, header + 10 );
+	EncodeUINT( bmp->Header.HeaderSize, header + 14 );
+	EncodeUINT( bmp->Header.Width, header + 18 );
+	EncodeUINT( bmp->Header.Height, header + 22 );
+	EncodeUSHORT( bmp->Header.Planes, header + 26 );
+	EncodeUSHORT( bmp->Header.BitsPerPixel, header + 28 );
+	EncodeUINT( bmp->Header.CompressionType, header + 30 );
+	EncodeUINT( bmp->Header.ImageDataSize, header + 34 );
+	EncodeUINT( bmp->Header.HPixelsPerMeter, header + 38 );
+	EncodeUINT( bmp->Header.VPixelsPerMeter, header + 42 );
+	EncodeUINT( bmp->Header.ColorsUsed, header + 46 );
+	EncodeUINT( bmp->Header.ColorsRequired, header + 50 );
+}
 
-	if ( x == NULL || f == NULL )
-	{
-		return 0;
-	}
 
-	if ( fread( little, 2, 1, f ) != 1 )
-	{
-		return 0;
-	}
+/**************************************************************
+	Decodes a little-endian 32 bit unsigned int. Compilers turn
+	this into a single load on little-endian systems.
+**************************************************************/
+UINT DecodeUINT( const UCHAR* little )
+{
+	return ( (UINT)little[ 3 ] << 24 | (UINT)little[ 2 ] << 16 | (UINT)little[ 1 ] << 8 | (UINT)little[ 0 ] );
+}
 
-	*x = ( little[ 1 ] << 8 | little[ 0 ] );
 
-	return 1;
+/**************************************************************
+	Decodes a little-endian 16 bit unsigned short int.
+**************************************************************/
+USHORT DecodeUSHORT( const UCHAR* little )
+{
+	return (USHORT)( little[ 1 ] << 8 | little[ 0 ] );
 }
 
 
 /**************************************************************
-	Writes a little-endian unsigned int to the file.
-	Returns non-zero on success.
+	Encodes an unsigned int as 32 little-endian bits.
 **************************************************************/
-int	WriteUINT( UINT x, FILE* f )
+void EncodeUINT( UINT x, UCHAR* little )
 {
-	UCHAR little[ 4 ];	/* BMPs use 32 bit ints */
-
 	little[ 3 ] = (UCHAR)( ( x & 0xff000000 ) >> 24 );
 	little[ 2 ] = (UCHAR)( ( x & 0x00ff0000 ) >> 16 );
 	little[ 1 ] = (UCHAR)( ( x & 0x0000ff00 ) >> 8 );
 	little[ 0 ] = (UCHAR)( ( x & 0x000000ff ) >> 0 );
-
-	return ( f && fwrite( little, 4, 1, f ) == 1 );
 }
 
 
 /**************************************************************
-	Writes a little-endian unsigned short int to the file.
-	Returns non-zero on success.
+	Encodes an unsigned short int as 16 little-endian bits.
 **************************************************************/
-int	WriteUSHORT( USHORT x, FILE* f )
+void EncodeUSHORT( USHORT x, UCHAR* little )
 {
-	UCHAR little[ 2 ];	/* BMPs use 16 bit shorts */
-
 	little[ 1 ] = (UCHAR)( ( x & 0xff00 ) >> 8 );
 	little[ 0 ] = (UCHAR)( ( x & 0x00ff ) >> 0 );
-
-	return ( f && fwrite( little, 2, 1, f ) == 1 );
-};
-
+}
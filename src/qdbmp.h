@@ -97,6 +97,7 @@ void			BMP_Free					( BMP* bmp );
 /* I/O */
 BMP*			BMP_ReadFile				( const char* filename );
 void			BMP_WriteFile				( BMP* bmp, const char* filename );
+void			BMP_ProbeFile				( const char* filename, UINT* width, UINT* height, USHORT* depth );
 
 
 /* Meta info */
@@ -112,6 +113,13 @@ void			BMP_GetPixelIndex			( BMP* bmp, UINT x, UINT y, UCHAR* val );
 void			BMP_SetPixelIndex			( BMP* bmp, UINT x, UINT y, UCHAR val );
 
 
+/* Row access */
+UCHAR*			BMP_GetRow					( BMP* bmp, UINT y, UINT* bytes_per_row );
+void			BMP_TransformRows			( BMP* bmp, UINT y, UINT count,
+											  void ( *transform )( UCHAR* row, UINT width, USHORT depth, void* context ),
+											  void* context );
+
+
 /* Palette handling */
 void			BMP_GetPaletteColor			( BMP* bmp, UCHAR index, UCHAR* r, UCHAR* g, UCHAR* b );
 void			BMP_SetPaletteColor			( BMP* bmp, UCHAR index, UCHAR r, UCHAR g, UCHAR b );
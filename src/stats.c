@@ -0,0 +1,99 @@
+#include "stats.h"
+#include <stdio.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#define NANOSECONDS_PER_SECOND 1000000000ULL
+
+typedef struct {
+    unsigned long long calls;
+    unsigned long long nanoseconds;
+    unsigned long long bytes;
+} STATS_TOTALS;
+
+static const char* PHASE_NAMES[] = {"open", "read", "transform", "compare", "write"};
+
+static STATS_TOTALS totals[STATS_PHASES_COUNT];
+static int enabled = 0;
+static STATS_FORMAT output_format = STATS_TEXT;
+static unsigned long long enabled_at = 0;
+
+static unsigned long long get_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * NANOSECONDS_PER_SECOND + now.tv_nsec;
+}
+
+int stats_enable(STATS_FORMAT format) {
+#ifdef BMP_STATS
+    output_format = format;
+    enabled_at = get_now();
+    __atomic_store_n(&enabled, 1, __ATOMIC_RELEASE);
+    return 1;
+#else
+    (void)format;
+    return 0;
+#endif
+}
+
+int stats_enabled() {
+    return __atomic_load_n(&enabled, __ATOMIC_RELAXED);
+}
+
+STATS_TIMER stats_start_timer(STATS_PHASE phase) {
+    STATS_TIMER timer = {phase, 0};
+    if (stats_enabled()) {
+        timer.start = get_now();
+    }
+    return timer;
+}
+
+void stats_stop_timer(STATS_TIMER* timer) {
+    if (timer->start == 0) {
+        return;
+    }
+    __atomic_fetch_add(&totals[timer->phase].nanoseconds, get_now() - timer->start, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&totals[timer->phase].calls, 1, __ATOMIC_RELAXED);
+}
+
+void stats_count_bytes(STATS_PHASE phase, unsigned long long bytes) {
+    if (stats_enabled()) {
+        __atomic_fetch_add(&totals[phase].bytes, bytes, __ATOMIC_RELAXED);
+    }
+}
+
+/* Megabytes (10^6 bytes) per second, or 0 when the phase took no measurable time. */
+static double get_throughput(const STATS_TOTALS* phase) {
+    return phase->nanoseconds > 0 ? (double)phase->bytes * 1000.0 / (double)phase->nanoseconds : 0.0;
+}
+
+/* Kilobytes on Linux. */
+static long int get_peak_rss() {
+    struct rusage usage;
+    return getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_maxrss : 0;
+}
+
+void stats_print() {
+    if (!stats_enabled()) {
+        return;
+    }
+    double wall_seconds = (double)(get_now() - enabled_at) / NANOSECONDS_PER_SECOND;
+    if (output_format == STATS_JSON) {
+        fprintf(stderr, "{\"phases\": {");
+        for (int phase = 0; phase < STATS_PHASES_COUNT; phase++) {
+            fprintf(stderr, "%s\"%s\": {\"calls\": %llu, \"seconds\": %.6f, \"bytes\": %llu, \"mb_per_s\": %.1f}",
+                    phase > 0 ? ", " : "", PHASE_NAMES[phase], totals[phase].calls,
+                    (double)totals[phase].nanoseconds / NANOSECONDS_PER_SECOND, totals[phase].bytes,
+                    get_throughput(&totals[phase]));
+        }
+        fprintf(stderr, "}, \"wall_seconds\": %.6f, \"peak_rss_kb\": %ld}\n", wall_seconds, get_peak_rss());
+        return;
+    }
+    fprintf(stderr, "%-10s %8s %12s %14s %10s\n", "phase", "calls", "ms", "bytes", "MB/s");
+    for (int phase = 0; phase < STATS_PHASES_COUNT; phase++) {
+        fprintf(stderr, "%-10s %8llu %12.3f %14llu %10.1f\n", PHASE_NAMES[phase], totals[phase].calls,
+                (double)totals[phase].nanoseconds / 1e6, totals[phase].bytes, get_throughput(&totals[phase]));
+    }
+    fprintf(stderr, "%-10s %8s %12.3f\n", "wall", "", wall_seconds * 1e3);
+    fprintf(stderr, "peak RSS %ld KB\n", get_peak_rss());
+}
@@ -0,0 +1,54 @@
+#ifndef HOMEWORK_4_STATS_H
+#define HOMEWORK_4_STATS_H
+
+typedef enum {
+    /* Opening files and reading headers and palettes. */
+    STATS_OPEN = 0,
+    /* Reading pixel data. */
+    STATS_READ,
+    /* Negation and the other pixel and palette ops. */
+    STATS_TRANSFORM,
+    STATS_COMPARE,
+    /* Creating output files and writing or copying headers, palettes and pixel data. */
+    STATS_WRITE,
+    STATS_PHASES_COUNT
+} STATS_PHASE;
+
+typedef enum {
+    STATS_TEXT = 0,
+    STATS_JSON
+} STATS_FORMAT;
+
+typedef struct {
+    STATS_PHASE phase;
+    unsigned long long start;
+} STATS_TIMER;
+
+/* Starts collecting. Returns 0 if the timers were compiled out (BMP_STATS is not defined). */
+int stats_enable(STATS_FORMAT format);
+
+int stats_enabled();
+
+/* Writes the time, calls, bytes and throughput of every phase and the peak resident set size
+   to stderr, as a table or a single JSON object. */
+void stats_print();
+
+STATS_TIMER stats_start_timer(STATS_PHASE phase);
+
+void stats_stop_timer(STATS_TIMER* timer);
+
+void stats_count_bytes(STATS_PHASE phase, unsigned long long bytes);
+
+/* STATS_SCOPE times the phase from here to the end of the enclosing block, early returns included;
+   STATS_COUNT adds bytes to it. Without BMP_STATS both expand to nothing, and with it but without
+   stats_enable a timer costs a load and a branch. */
+#ifdef BMP_STATS
+#define STATS_SCOPE(phase) \
+    STATS_TIMER stats_timer_##phase __attribute__((cleanup(stats_stop_timer))) = stats_start_timer(phase)
+#define STATS_COUNT(phase, bytes) stats_count_bytes((phase), (bytes))
+#else
+#define STATS_SCOPE(phase)
+#define STATS_COUNT(phase, bytes)
+#endif
+
+#endif //HOMEWORK_4_STATS_H
@@ -0,0 +1,123 @@
+#include "thread_pool.h"
+#include <pthread.h>
+#include <stdlib.h>
+
+struct thread_pool {
+    pthread_t workers[MAX_THREADS_COUNT];
+    int workers_count;
+    pthread_mutex_t lock;
+    pthread_cond_t job_started;
+    pthread_cond_t job_finished;
+    unsigned long int generation;
+    int busy_workers;
+    int stopping;
+    long int count;
+    long int tile_size;
+    long int next_tile;
+    thread_pool_task task;
+    void* context;
+};
+
+static void run_tiles(Thread_Pool* pool) {
+    long int tiles_count = (pool->count + pool->tile_size - 1) / pool->tile_size;
+    long int tile;
+    while ((tile = __sync_fetch_and_add(&pool->next_tile, 1)) < tiles_count) {
+        long int begin = tile * pool->tile_size;
+        long int end = begin + pool->tile_size < pool->count ? begin + pool->tile_size : pool->count;
+        pool->task(begin, end, pool->context);
+    }
+}
+
+static void* worker_main(void* argument) {
+    Thread_Pool* pool = (Thread_Pool*)argument;
+    unsigned long int seen_generation = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->stopping && pool->generation == seen_generation) {
+            pthread_cond_wait(&pool->job_started, &pool->lock);
+        }
+        if (pool->stopping) {
+            break;
+        }
+        seen_generation = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+        run_tiles(pool);
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy_workers == 0) {
+            pthread_cond_signal(&pool->job_finished);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+Thread_Pool* thread_pool_create(int threads_count) {
+    Thread_Pool* pool;
+    if (threads_count < 1 || threads_count > MAX_THREADS_COUNT) {
+        return NULL;
+    }
+    pool = (Thread_Pool*)calloc(1, sizeof(Thread_Pool));
+    if (pool == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->job_started, NULL);
+    pthread_cond_init(&pool->job_finished, NULL);
+    for (; pool->workers_count < threads_count - 1; pool->workers_count++) {
+        if (pthread_create(&pool->workers[pool->workers_count], NULL, worker_main, pool) != 0) {
+            thread_pool_destroy(pool);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+void thread_pool_run(Thread_Pool* pool, long int count, long int tile_size, thread_pool_task task, void* context) {
+    if (count <= 0) {
+        return;
+    }
+    if (tile_size < 1) {
+        tile_size = 1;
+    }
+    if (pool == NULL || pool->workers_count == 0 || count <= tile_size) {
+        task(0, count, context);
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->count = count;
+    pool->tile_size = tile_size;
+    pool->next_tile = 0;
+    pool->task = task;
+    pool->context = context;
+    pool->busy_workers = pool->workers_count;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->job_started);
+    pthread_mutex_unlock(&pool->lock);
+    run_tiles(pool);
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy_workers > 0) {
+        pthread_cond_wait(&pool->job_finished, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+int thread_pool_size(Thread_Pool* pool) {
+    return pool == NULL ? 1 : pool->workers_count + 1;
+}
+
+void thread_pool_destroy(Thread_Pool* pool) {
+    if (pool == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->job_started);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->workers_count; i++) {
+        pthread_join(pool->workers[i], NULL);
+    }
+    pthread_cond_destroy(&pool->job_started);
+    pthread_cond_destroy(&pool->job_finished);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
@@ -0,0 +1,24 @@
+#ifndef HOMEWORK_4_THREAD_POOL_H
+#define HOMEWORK_4_THREAD_POOL_H
+
+#define MAX_THREADS_COUNT 256
+
+/* Processes the items [begin, end) of a parallel loop. */
+typedef void (*thread_pool_task)(long int begin, long int end, void* context);
+
+typedef struct thread_pool Thread_Pool;
+
+/* Starts threads_count - 1 workers; the thread calling thread_pool_run is the last one.
+   Returns NULL if threads_count is out of range or the workers could not be started. */
+Thread_Pool* thread_pool_create(int threads_count);
+
+/* Splits [0, count) into tiles of tile_size items and runs task on every tile. Idle threads
+   take the next unprocessed tile, so uneven tiles still keep every thread busy.
+   Returns when all tiles are done. */
+void thread_pool_run(Thread_Pool* pool, long int count, long int tile_size, thread_pool_task task, void* context);
+
+int thread_pool_size(Thread_Pool* pool);
+
+void thread_pool_destroy(Thread_Pool* pool);
+
+#endif //HOMEWORK_4_THREAD_POOL_H
@@ -0,0 +1,321 @@
+#include "transform.h"
+#include "negation.h"
+#include "lut.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#define error(...) (fprintf(stderr, __VA_ARGS__))
+#define TRANSFORM_CHUNK_PIXELS 4096
+
+static int get_channel(char letter) {
+    switch (tolower(letter)) {
+        case 'b':
+            return 0;
+        case 'g':
+            return 1;
+        case 'r':
+            return 2;
+        default:
+            return -1;
+    }
+}
+
+static unsigned char clamp_channel(double value) {
+    return value < 0 ? 0 : value > 255 ? 255 : (unsigned char)(value + 0.5);
+}
+
+static int has_name(char* spec, size_t name_length, const char* name) {
+    return strlen(name) == name_length && strncmp(spec, name, name_length) == 0;
+}
+
+static int scan_number(char* argument, double minimum, double maximum, double* number) {
+    char* end;
+    *number = strtod(argument, &end);
+    return *argument != '\0' && *end == '\0' && *number >= minimum && *number <= maximum;
+}
+
+static int read_lut_file(char* filename, TRANSFORM_OP* op) {
+    unsigned char bytes[TRANSFORM_CHANNELS_COUNT * 256 + 1];
+    FILE* f = fopen(filename, "rb");
+    if (f == NULL) {
+        error("Could not open the table %s\n", filename);
+        return 1;
+    }
+    size_t size = fread(bytes, 1, sizeof(bytes), f);
+    fclose(f);
+    if (size != 256 && size != TRANSFORM_CHANNELS_COUNT * 256) {
+        error("Table %s must hold 256 or 768 bytes\n", filename);
+        return 1;
+    }
+    for (int c = 0; c < TRANSFORM_CHANNELS_COUNT; c++) {
+        memcpy(op->tables[c], size == 256 ? bytes : bytes + c * 256, 256);
+    }
+    return 0;
+}
+
+int add_transform_op(TRANSFORM_CHAIN* chain, char* spec) {
+    TRANSFORM_OP* op;
+    char* argument = strchr(spec, '=');
+    size_t name_length = argument != NULL ? (size_t)(argument - spec) : strlen(spec);
+    double number;
+    if (chain->count == MAX_TRANSFORM_OPS) {
+        error("No more than %d operations can be chained\n", MAX_TRANSFORM_OPS);
+        return 1;
+    }
+    op = &chain->ops[chain->count];
+    memset(op, 0, sizeof(TRANSFORM_OP));
+    argument = argument != NULL ? argument + 1 : NULL;
+    if (has_name(spec, name_length, "negate") && argument == NULL) {
+        op->type = TRANSFORM_NEGATE;
+    } else if (has_name(spec, name_length, "invert") && argument != NULL && *argument != '\0') {
+        op->type = TRANSFORM_INVERT;
+        for (char* letter = argument; *letter != '\0'; letter++) {
+            int channel = get_channel(*letter);
+            if (channel < 0) {
+                error("Unknown channel %c in %s\n", *letter, spec);
+                return 1;
+            }
+            op->masks[channel] = 0xFF;
+        }
+    } else if (has_name(spec, name_length, "threshold") && argument != NULL) {
+        op->type = TRANSFORM_THRESHOLD;
+        if (!scan_number(argument, 0, 255, &number)) {
+            error("%s\n", "Threshold must be a number from 0 to 255");
+            return 1;
+        }
+        op->level = (int)number;
+    } else if (has_name(spec, name_length, "lut") && argument != NULL) {
+        op->type = TRANSFORM_LUT;
+        if (read_lut_file(argument, op)) {
+            return 1;
+        }
+    } else if (has_name(spec, name_length, "brightness") && argument != NULL) {
+        op->type = TRANSFORM_BRIGHTNESS;
+        if (!scan_number(argument, -255, 255, &number)) {
+            error("%s\n", "Brightness must be a number from -255 to 255");
+            return 1;
+        }
+        for (int c = 0; c < TRANSFORM_CHANNELS_COUNT; c++) {
+            for (int value = 0; value < 256; value++) {
+                op->tables[c][value] = clamp_channel(value + number);
+            }
+        }
+    } else if (has_name(spec, name_length, "contrast") && argument != NULL) {
+        op->type = TRANSFORM_CONTRAST;
+        if (!scan_number(argument, 0, 255, &number)) {
+            error("%s\n", "Contrast must be a factor from 0 to 255");
+            return 1;
+        }
+        for (int c = 0; c < TRANSFORM_CHANNELS_COUNT; c++) {
+            for (int value = 0; value < 256; value++) {
+                op->tables[c][value] = clamp_channel((value - 128) * number + 128);
+            }
+        }
+    } else if (has_name(spec, name_length, "gamma") && argument != NULL) {
+        op->type = TRANSFORM_GAMMA;
+        if (!scan_number(argument, 0.01, 100, &number)) {
+            error("%s\n", "Gamma must be a number from 0.01 to 100");
+            return 1;
+        }
+        for (int value = 0; value < 256; value++) {
+            op->tables[0][value] = clamp_channel(255 * pow(value / 255.0, number));
+        }
+        memcpy(op->tables[1], op->tables[0], 256);
+        memcpy(op->tables[2], op->tables[0], 256);
+    } else if (has_name(spec, name_length, "levels") && argument != NULL) {
+        int black, white, length = 0;
+        op->type = TRANSFORM_LEVELS;
+        if (sscanf(argument, "%d:%d%n", &black, &white, &length) != 2 || argument[length] != '\0'
+            || black < 0 || white > 255 || black >= white) {
+            error("%s\n", "Levels must be two values 0 <= black < white <= 255, e.g. levels=16:235");
+            return 1;
+        }
+        for (int value = 0; value < 256; value++) {
+            op->tables[0][value] = clamp_channel((value - black) * 255.0 / (white - black));
+        }
+        memcpy(op->tables[1], op->tables[0], 256);
+        memcpy(op->tables[2], op->tables[0], 256);
+    } else if (has_name(spec, name_length, "posterize") && argument != NULL) {
+        op->type = TRANSFORM_POSTERIZE;
+        if (!scan_number(argument, 2, 256, &number) || number != (int)number) {
+            error("%s\n", "Posterize needs a whole number of levels from 2 to 256");
+            return 1;
+        }
+        for (int value = 0; value < 256; value++) {
+            int level = value * (int)number / 256;
+            op->tables[0][value] = clamp_channel(level * 255.0 / (number - 1));
+        }
+        memcpy(op->tables[1], op->tables[0], 256);
+        memcpy(op->tables[2], op->tables[0], 256);
+    } else if (has_name(spec, name_length, "swap") && argument != NULL) {
+        op->type = TRANSFORM_SWAP;
+        op->first_channel = get_channel(argument[0]);
+        op->second_channel = argument[0] != '\0' ? get_channel(argument[1]) : -1;
+        if (op->first_channel < 0 || op->second_channel < 0 || argument[2] != '\0'
+            || op->first_channel == op->second_channel) {
+            error("%s\n", "Swap needs two different channels out of r, g and b, e.g. swap=rb");
+            return 1;
+        }
+    } else {
+        error("Unknown operation %s\n", spec);
+        return 1;
+    }
+    chain->count++;
+    return 0;
+}
+
+static int is_per_channel(const TRANSFORM_OP* op) {
+    return op->type != TRANSFORM_THRESHOLD && op->type != TRANSFORM_SWAP;
+}
+
+static unsigned char map_channel(const TRANSFORM_OP* op, int channel, unsigned char value) {
+    switch (op->type) {
+        case TRANSFORM_NEGATE:
+            return ~value;
+        case TRANSFORM_INVERT:
+            return value ^ op->masks[channel];
+        default:
+            return op->tables[channel][value];
+    }
+}
+
+/* Appends the fused run held in op, or a negate or nothing when that is all it does. */
+static void flush_run(TRANSFORM_OP* op, TRANSFORM_CHAIN* compiled) {
+    int is_identity = 1, is_negation = 1;
+    for (int c = 0; c < TRANSFORM_CHANNELS_COUNT; c++) {
+        for (int value = 0; value < 256; value++) {
+            is_identity &= op->tables[c][value] == value;
+            is_negation &= op->tables[c][value] == 255 - value;
+        }
+    }
+    if (is_identity) {
+        return;
+    }
+    if (is_negation) {
+        memset(op, 0, sizeof(TRANSFORM_OP));
+        op->type = TRANSFORM_NEGATE;
+    }
+    compiled->ops[compiled->count++] = *op;
+}
+
+void compile_transform_chain(const TRANSFORM_CHAIN* chain, TRANSFORM_CHAIN* compiled) {
+    TRANSFORM_OP run;
+    int run_length = 0;
+    compiled->count = 0;
+    for (int i = 0; i <= chain->count; i++) {
+        const TRANSFORM_OP* op = i < chain->count ? &chain->ops[i] : NULL;
+        if (op != NULL && is_per_channel(op)) {
+            if (run_length++ == 0) {
+                memset(&run, 0, sizeof(TRANSFORM_OP));
+                run.type = TRANSFORM_LUT;
+                for (int c = 0; c < TRANSFORM_CHANNELS_COUNT; c++) {
+                    for (int value = 0; value < 256; value++) {
+                        run.tables[c][value] = (unsigned char)value;
+                    }
+                }
+            }
+            for (int c = 0; c < TRANSFORM_CHANNELS_COUNT; c++) {
+                for (int value = 0; value < 256; value++) {
+                    run.tables[c][value] = map_channel(op, c, run.tables[c][value]);
+                }
+            }
+            continue;
+        }
+        if (run_length > 0) {
+            flush_run(&run, compiled);
+            run_length = 0;
+        }
+        if (op != NULL) {
+            compiled->ops[compiled->count++] = *op;
+        }
+    }
+}
+
+int is_plain_negation(const TRANSFORM_CHAIN* chain) {
+    return chain->count == 1 && chain->ops[0].type == TRANSFORM_NEGATE;
+}
+
+static void apply_op(const TRANSFORM_OP* op, unsigned char* destination, const unsigned char* source,
+                     long int count, int pixel_size) {
+    long int size = count * pixel_size;
+    switch (op->type) {
+        case TRANSFORM_NEGATE:
+            if (pixel_size == TRANSFORM_CHANNELS_COUNT) {
+                negate_bytes(destination, source, size);
+            } else {
+                negate_bgra_pixels(destination, source, size);
+            }
+            break;
+        case TRANSFORM_INVERT:
+            for (long int i = 0; i < size; i += pixel_size) {
+                destination[i] = source[i] ^ op->masks[0];
+                destination[i + 1] = source[i + 1] ^ op->masks[1];
+                destination[i + 2] = source[i + 2] ^ op->masks[2];
+            }
+            break;
+        case TRANSFORM_THRESHOLD:
+            for (long int i = 0; i < size; i += pixel_size) {
+                int luminance = (29 * source[i] + 150 * source[i + 1] + 77 * source[i + 2]) >> 8;
+                unsigned char value = luminance >= op->level ? 255 : 0;
+                destination[i] = destination[i + 1] = destination[i + 2] = value;
+            }
+            break;
+        case TRANSFORM_LUT:
+        case TRANSFORM_BRIGHTNESS:
+        case TRANSFORM_CONTRAST:
+        case TRANSFORM_GAMMA:
+        case TRANSFORM_LEVELS:
+        case TRANSFORM_POSTERIZE:
+            if (pixel_size == TRANSFORM_CHANNELS_COUNT) {
+                lookup_pixels(destination, source, size, op->tables);
+                break;
+            }
+            for (long int i = 0; i < size; i += pixel_size) {
+                destination[i] = op->tables[0][source[i]];
+                destination[i + 1] = op->tables[1][source[i + 1]];
+                destination[i + 2] = op->tables[2][source[i + 2]];
+            }
+            break;
+        case TRANSFORM_SWAP:
+            for (long int i = 0; i < size; i += pixel_size) {
+                unsigned char pixel[TRANSFORM_CHANNELS_COUNT] = {source[i], source[i + 1], source[i + 2]};
+                unsigned char first = pixel[op->first_channel];
+                pixel[op->first_channel] = pixel[op->second_channel];
+                pixel[op->second_channel] = first;
+                destination[i] = pixel[0];
+                destination[i + 1] = pixel[1];
+                destination[i + 2] = pixel[2];
+            }
+            break;
+    }
+}
+
+void transform_pixels(const TRANSFORM_CHAIN* chain, unsigned char* destination, const unsigned char* source,
+                      long int count, int pixel_size) {
+    if (chain->count == 0) {
+        if (destination != source) {
+            memcpy(destination, source, count * pixel_size);
+        }
+        return;
+    }
+    for (long int begin = 0; begin < count; begin += TRANSFORM_CHUNK_PIXELS) {
+        long int chunk = count - begin < TRANSFORM_CHUNK_PIXELS ? count - begin : TRANSFORM_CHUNK_PIXELS;
+        unsigned char* to = destination + begin * pixel_size;
+        const unsigned char* from = source + begin * pixel_size;
+        if (to != from && pixel_size != TRANSFORM_CHANNELS_COUNT) {
+            memcpy(to, from, chunk * pixel_size);
+            from = to;
+        }
+        for (int i = 0; i < chain->count; i++) {
+            apply_op(&chain->ops[i], to, from, chunk, pixel_size);
+            from = to;
+        }
+    }
+}
+
+void transform_palette(const TRANSFORM_CHAIN* chain, unsigned char* palette, int colors_count) {
+    transform_pixels(chain, palette, palette, colors_count, 4);
+}
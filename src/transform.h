@@ -0,0 +1,74 @@
+#include <stddef.h>
+
+#ifndef HOMEWORK_4_TRANSFORM_H
+#define HOMEWORK_4_TRANSFORM_H
+
+#define MAX_TRANSFORM_OPS 16
+#define TRANSFORM_CHANNELS_COUNT 3
+
+typedef enum {
+    TRANSFORM_NEGATE,
+    TRANSFORM_INVERT,
+    TRANSFORM_THRESHOLD,
+    TRANSFORM_LUT,
+    TRANSFORM_BRIGHTNESS,
+    TRANSFORM_CONTRAST,
+    TRANSFORM_GAMMA,
+    TRANSFORM_LEVELS,
+    TRANSFORM_POSTERIZE,
+    TRANSFORM_SWAP
+} TRANSFORM_TYPE;
+
+/* Channels are numbered in stored order: 0 is blue, 1 green, 2 red. */
+typedef struct {
+    TRANSFORM_TYPE type;
+    /* TRANSFORM_INVERT: 0xFF for every inverted channel, 0 for the others. */
+    unsigned char masks[TRANSFORM_CHANNELS_COUNT];
+    /* TRANSFORM_THRESHOLD: pixels at least this bright become white, the others black. */
+    int level;
+    /* TRANSFORM_SWAP: the two channels that trade places. */
+    int first_channel;
+    int second_channel;
+    /* Every per-channel op other than negate and invert: new value of each channel value. */
+    unsigned char tables[TRANSFORM_CHANNELS_COUNT][256];
+} TRANSFORM_OP;
+
+typedef struct {
+    TRANSFORM_OP ops[MAX_TRANSFORM_OPS];
+    int count;
+} TRANSFORM_CHAIN;
+
+/* Appends the op described by spec to the chain:
+     negate              invert every channel
+     invert=<channels>   invert some of the channels, e.g. invert=rg
+     threshold=<0..255>  black and white by luminance
+     lut=<file>          256 bytes applied to every channel, or 768 bytes: blue, green, then red table
+     brightness=<-255..255>
+     contrast=<factor>   scales the distance from mid-grey, e.g. contrast=1.5
+     gamma=<exponent>    e.g. gamma=2.2 darkens the midtones
+     levels=<black>:<white>  stretches that range of values to 0..255
+     posterize=<2..256>  keeps that many values per channel
+     swap=<two channels> e.g. swap=rb turns BGR into RGB
+   Returns 0 on success; otherwise prints the problem to stderr and returns 1. */
+int add_transform_op(TRANSFORM_CHAIN* chain, char* spec);
+
+/* Fuses every run of per-channel ops (all but threshold and swap) into one lookup table per
+   channel, so a run costs one table lookup per byte however long it is. A run that works
+   out to negation becomes a negate and a run that changes nothing is dropped. */
+void compile_transform_chain(const TRANSFORM_CHAIN* chain, TRANSFORM_CHAIN* compiled);
+
+/* Non-zero if the chain is a single negate, which may run over whole rows including padding
+   (negate_bytes for 24 bpp, negate_bgra_pixels for 32 bpp). */
+int is_plain_negation(const TRANSFORM_CHAIN* chain);
+
+/* Runs the whole chain over count pixels of pixel_size bytes: 3 for 24 bpp, 4 for 32 bpp and palette
+   entries, whose fourth byte (alpha or reserved) is copied as it is. The pixels are taken in chunks
+   small enough to stay in the L1 cache, and every op of the chain is applied to a chunk before moving
+   on, so a chain costs one pass over memory. destination may be source. */
+void transform_pixels(const TRANSFORM_CHAIN* chain, unsigned char* destination, const unsigned char* source,
+                      long int count, int pixel_size);
+
+/* Runs the chain over the colours of a palette in place: 256 for 8 bpp and 16 for 4 bpp images. */
+void transform_palette(const TRANSFORM_CHAIN* chain, unsigned char* palette, int colors_count);
+
+#endif //HOMEWORK_4_TRANSFORM_H
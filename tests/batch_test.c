@@ -0,0 +1,104 @@
+/* Runs batches whose images differ in depth through run_batch, which reads every entry into
+   the same two reused objects, and checks that each image is written back unchanged. */
+#define _GNU_SOURCE
+#include "../src/batch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_PATH_SIZE 256
+#define MAX_FILE_SIZE 4096
+#define ENTRIES_COUNT 4
+
+#define check(condition) \
+    if (!(condition)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+        return 1; \
+    }
+
+/* Writes a bottom-up BMP whose palette and pixels are filled from seed. */
+static int generate_image(char* filename, long int width, long int height, short bits_per_pixel, unsigned int seed) {
+    BMPv3 bmp;
+    unsigned char palette[256 * 4];
+    unsigned char data[MAX_FILE_SIZE];
+    memset(&bmp, 0, sizeof(BMPv3));
+    bmp.header.magic = 0x4D42;
+    bmp.header.header_size = 40;
+    bmp.header.width = width;
+    bmp.header.height = height;
+    bmp.header.planes = 1;
+    bmp.header.bits_per_pixel = bits_per_pixel;
+    bmp.header.image_data_size = get_BMPv3_row_size(&bmp) * height;
+    bmp.header.data_offset = get_BMPv3_data_offset(&bmp);
+    bmp.header.file_size = bmp.header.data_offset + bmp.header.image_data_size;
+    for (int i = 0; i < (int)sizeof(palette); i++) {
+        seed = seed * 1103515245 + 12345;
+        palette[i] = (i + 1) % 4 == 0 ? 0 : (unsigned char)(seed >> 16);
+    }
+    for (long int i = 0; i < bmp.header.image_data_size; i++) {
+        seed = seed * 1103515245 + 12345;
+        data[i] = (unsigned char)(seed >> 16);
+    }
+    bmp.palette = palette;
+    bmp.data = data;
+    write_BMPv3_file(&bmp, filename);
+    return BMP_get_error() != BMPv3_OK;
+}
+
+static long int read_file(char* filename, unsigned char* contents) {
+    FILE* f = fopen(filename, "rb");
+    long int size;
+    if (f == NULL) {
+        return -1;
+    }
+    size = (long int)fread(contents, 1, MAX_FILE_SIZE, f);
+    fclose(f);
+    return size;
+}
+
+static int keep_image(BMPv3* image, void* context) {
+    (void)image;
+    (void)context;
+    return 0;
+}
+
+/* The 4 bpp image comes first, so the object it was read into later holds an 8 bpp one. */
+static int test_mixed_depths() {
+    static const short DEPTHS[ENTRIES_COUNT] = {4, 8, 8, 24};
+    char directory[] = "/tmp/batch_test_XXXXXX";
+    char names[2 * ENTRIES_COUNT][MAX_PATH_SIZE];
+    BATCH_ENTRY entries[ENTRIES_COUNT];
+    BATCH batch = {entries, ENTRIES_COUNT, ENTRIES_COUNT};
+    unsigned char input[MAX_FILE_SIZE], output[MAX_FILE_SIZE];
+    long int input_size, output_size;
+    int failed_count;
+    check(mkdtemp(directory) != NULL);
+    for (int i = 0; i < ENTRIES_COUNT; i++) {
+        snprintf(names[2 * i], MAX_PATH_SIZE, "%s/in%d.bmp", directory, i);
+        snprintf(names[2 * i + 1], MAX_PATH_SIZE, "%s/out%d.bmp", directory, i);
+        entries[i].input_filename = names[2 * i];
+        entries[i].output_filename = names[2 * i + 1];
+        check(generate_image(entries[i].input_filename, 7 + i, 5, DEPTHS[i], 12345 + i) == 0);
+    }
+    failed_count = run_batch(&batch, keep_image, NULL);
+    BMPv3_pool_clear();
+    for (int i = 0; i < ENTRIES_COUNT; i++) {
+        input_size = read_file(entries[i].input_filename, input);
+        output_size = read_file(entries[i].output_filename, output);
+        unlink(entries[i].input_filename);
+        unlink(entries[i].output_filename);
+        check(input_size > 0 && output_size == input_size && memcmp(input, output, input_size) == 0);
+    }
+    rmdir(directory);
+    check(failed_count == 0);
+    return 0;
+}
+
+int main() {
+    int failed = test_mixed_depths();
+    if (!failed) {
+        printf("%s\n", "batch_test passed");
+    }
+    return failed;
+}
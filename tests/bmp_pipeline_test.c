@@ -0,0 +1,125 @@
+/* Drives the io_uring pipeline's completion handling with completions posted by hand, so writes
+   can be made to finish in an order the kernel is free to pick but rarely does. */
+#include "../src/bmp_pipeline.c"
+#include <stdio.h>
+
+#define BAND_SIZE 16
+#define BANDS_COUNT 10
+#define SQ_ENTRIES (2 * BMPv3_PIPELINE_DEPTH)
+#define CQ_ENTRIES (4 * BMPv3_PIPELINE_DEPTH)
+
+#define check(condition) \
+    if (!(condition)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+        return 1; \
+    }
+
+typedef struct {
+    URING ring;
+    PIPELINE pipeline;
+    unsigned int sq_tail, sq_mask, cq_head, cq_tail, cq_mask;
+    unsigned int sq_array[SQ_ENTRIES];
+    struct io_uring_sqe sqes[SQ_ENTRIES];
+    struct io_uring_cqe cqes[CQ_ENTRIES];
+    unsigned char buffers[BMPv3_PIPELINE_DEPTH][BAND_SIZE];
+} FAKE_URING;
+
+static void init_fake_uring(FAKE_URING* fake) {
+    memset(fake, 0, sizeof(FAKE_URING));
+    fake->sq_mask = SQ_ENTRIES - 1;
+    fake->cq_mask = CQ_ENTRIES - 1;
+    fake->ring.fd = -1;
+    fake->ring.sq_tail = &fake->sq_tail;
+    fake->ring.sq_mask = &fake->sq_mask;
+    fake->ring.sq_array = fake->sq_array;
+    fake->ring.sqes = fake->sqes;
+    fake->ring.cq_head = &fake->cq_head;
+    fake->ring.cq_tail = &fake->cq_tail;
+    fake->ring.cq_mask = &fake->cq_mask;
+    fake->ring.cqes = fake->cqes;
+    fake->pipeline.data_size = BANDS_COUNT * BAND_SIZE;
+    fake->pipeline.band_size = BAND_SIZE;
+    fake->pipeline.bands_count = BANDS_COUNT;
+    for (int i = 0; i < BMPv3_PIPELINE_DEPTH; i++) {
+        fake->pipeline.slots[i] = fake->buffers[i];
+    }
+}
+
+/* Plays the kernel: takes every queued request and posts a full completion for the slot's one. */
+static void complete_slot(FAKE_URING* fake, int slot) {
+    fake->ring.to_submit = 0;
+    fake->cqes[fake->cq_tail & fake->cq_mask].user_data = slot;
+    fake->cqes[fake->cq_tail & fake->cq_mask].res = (int)get_band_length(&fake->pipeline, fake->ring.bands[slot]);
+    fake->cq_tail++;
+}
+
+static const struct io_uring_sqe* get_last_request(FAKE_URING* fake) {
+    return &fake->sqes[(fake->sq_tail - 1) & fake->sq_mask];
+}
+
+/* Checks that slot holds band being read into the slot's own buffer. */
+static int is_reading(FAKE_URING* fake, int slot, long int band) {
+    const struct io_uring_sqe* sqe = get_last_request(fake);
+    const struct iovec* vector = (const struct iovec*)(size_t)sqe->addr;
+    return fake->ring.states[slot] == SLOT_READING && fake->ring.bands[slot] == band
+           && sqe->opcode == IORING_OP_READV && sqe->user_data == (unsigned long long int)slot
+           && sqe->off == (unsigned long long int)(band * BAND_SIZE) && vector->iov_base == fake->buffers[slot];
+}
+
+static int test_writes_completing_out_of_order() {
+    static FAKE_URING fake;
+    init_fake_uring(&fake);
+    for (long int band = 0; band < BMPv3_PIPELINE_DEPTH; band++) {
+        start_band(&fake.ring, &fake.pipeline, band, SLOT_READING);
+    }
+    for (int slot = 0; slot < BMPv3_PIPELINE_DEPTH; slot++) {
+        complete_slot(&fake, slot);
+    }
+    check(reap_completions(&fake.ring, &fake.pipeline, BMPv3_OK) == BMPv3_OK);
+    for (long int band = 0; band < BMPv3_PIPELINE_DEPTH; band++) {
+        check(fake.ring.states[band] == SLOT_READ);
+        start_band(&fake.ring, &fake.pipeline, band, SLOT_WRITING);
+    }
+
+    /* Band 1 is written before band 0: slot 1 takes band 5 and slot 0 keeps writing band 0. */
+    complete_slot(&fake, 1);
+    check(reap_completions(&fake.ring, &fake.pipeline, BMPv3_OK) == BMPv3_OK);
+    check(is_reading(&fake, 1, 1 + BMPv3_PIPELINE_DEPTH));
+    check(fake.ring.states[0] == SLOT_WRITING && fake.ring.bands[0] == 0);
+
+    complete_slot(&fake, 3);
+    check(reap_completions(&fake.ring, &fake.pipeline, BMPv3_OK) == BMPv3_OK);
+    check(is_reading(&fake, 3, 3 + BMPv3_PIPELINE_DEPTH));
+    check(fake.ring.states[0] == SLOT_WRITING && fake.ring.states[2] == SLOT_WRITING);
+
+    complete_slot(&fake, 0);
+    check(reap_completions(&fake.ring, &fake.pipeline, BMPv3_OK) == BMPv3_OK);
+    check(is_reading(&fake, 0, BMPv3_PIPELINE_DEPTH));
+
+    /* The read of band 5 finishes; the late write of band 2 must not be taken for it. */
+    complete_slot(&fake, 1);
+    complete_slot(&fake, 2);
+    check(reap_completions(&fake.ring, &fake.pipeline, BMPv3_OK) == BMPv3_OK);
+    check(fake.ring.states[1] == SLOT_READ && fake.ring.bands[1] == 1 + BMPv3_PIPELINE_DEPTH);
+    check(is_reading(&fake, 2, 2 + BMPv3_PIPELINE_DEPTH));
+    check(fake.ring.written_count == BMPv3_PIPELINE_DEPTH);
+    check(fake.ring.in_flight == 3);
+
+    /* Band 2 + BMPv3_PIPELINE_DEPTH is the last one to share slot 2, so its write refills nothing. */
+    complete_slot(&fake, 2);
+    check(reap_completions(&fake.ring, &fake.pipeline, BMPv3_OK) == BMPv3_OK);
+    start_band(&fake.ring, &fake.pipeline, 2 + BMPv3_PIPELINE_DEPTH, SLOT_WRITING);
+    unsigned int requests_count = fake.sq_tail;
+    complete_slot(&fake, 2);
+    check(reap_completions(&fake.ring, &fake.pipeline, BMPv3_OK) == BMPv3_OK);
+    check(fake.sq_tail == requests_count && fake.ring.written_count == BMPv3_PIPELINE_DEPTH + 1);
+    return 0;
+}
+
+int main() {
+    int failed = test_writes_completing_out_of_order();
+    if (!failed) {
+        printf("%s\n", "bmp_pipeline_test passed");
+    }
+    return failed;
+}